@@ -217,3 +217,57 @@ TEST_F(Normal3Test, Operations)
     EXPECT_TRUE(equal(Normalize(i), i));
 }
 
+
+// Bounds tests
+
+TEST_F(Bounds2iCurveTest, VisitsEachPoint)
+{
+    for (SpaceFillingCurve curve : { SpaceFillingCurve::Morton, SpaceFillingCurve::Hilbert })
+    {
+        EXPECT_TRUE(visitsEachPointOnce(bounds(0, 0, 8, 8), curve));
+        EXPECT_TRUE(visitsEachPointOnce(bounds(0, 0, 7, 5), curve));
+        EXPECT_TRUE(visitsEachPointOnce(bounds(-3, 2, 60, 34), curve));
+        EXPECT_TRUE(visitsEachPointOnce(bounds(0, 0, 100, 1), curve));
+    }
+}
+
+TEST_F(Bounds2iCurveTest, EmptyBounds)
+{
+    Bounds2i b = bounds(2, 2, 2, 5);
+    Bounds2iCurve range(b, SpaceFillingCurve::Hilbert);
+    EXPECT_TRUE(range.begin() == range.end());
+}
+
+TEST_F(Bounds2iCurveTest, HilbertStepsToNeighbours)
+{
+    Bounds2i b = bounds(0, 0, 16, 16);
+    Bounds2iCurve range(b, SpaceFillingCurve::Hilbert);
+    Bounds2iCurveIterator it = range.begin();
+    Point2i prev = *it;
+    for (++it; it != range.end(); ++it)
+    {
+        Point2i p = *it;
+        EXPECT_EQ(std::abs(p.x - prev.x) + std::abs(p.y - prev.y), 1);
+        prev = p;
+    }
+}
+
+TEST_F(Bounds2iCurveTest, BlocksFitInShorterSide)
+{
+    // A 12x6 extent is covered with 4x4 blocks, so after the first block the curve moves on to the next one
+    // along x rather than further up into an 8x8 block that sticks out of the bounds.
+    Bounds2i b = bounds(0, 0, 12, 6);
+    Bounds2iCurve range(b, SpaceFillingCurve::Hilbert);
+    Bounds2iCurveIterator it = range.begin();
+    for (int i = 0; i < 16; ++i, ++it)
+    {
+        EXPECT_LT((*it).x, 4);
+        EXPECT_LT((*it).y, 4);
+    }
+    for (int i = 0; i < 16; ++i, ++it)
+    {
+        EXPECT_GE((*it).x, 4);
+        EXPECT_LT((*it).x, 8);
+        EXPECT_LT((*it).y, 4);
+    }
+}
@@ -153,3 +153,33 @@ protected:
     Normal3<int> i_plus_j{ 1, 1, 0 };   // i + j
     Normal3<int> i_minus_j{ 1, -1, 0 }; // i - j
 };
+
+// Bounds tests
+
+class Bounds2iCurveTest : public ::testing::Test
+{
+protected:
+    // void SetUp() override {}
+    // void TearDown() override {}
+
+    Bounds2i bounds(int x0, int y0, int x1, int y1)
+    {
+        Bounds2i b;
+        b.pMin = Point2i{ x0, y0 };
+        b.pMax = Point2i{ x1, y1 };
+        return b;
+    }
+
+    // True if iterating over b along the curve comes across every point inside b exactly once.
+    bool visitsEachPointOnce(const Bounds2i& b, SpaceFillingCurve curve)
+    {
+        int nx = b.pMax.x - b.pMin.x, ny = b.pMax.y - b.pMin.y;
+        std::vector<int> visits(nx * ny, 0);
+        for (Point2i p : Bounds2iCurve(b, curve))
+        {
+            if (p.x < b.pMin.x || p.x >= b.pMax.x || p.y < b.pMin.y || p.y >= b.pMax.y) return false;
+            ++visits[(p.y - b.pMin.y) * nx + (p.x - b.pMin.x)];
+        }
+        return std::all_of(visits.begin(), visits.end(), [](int v) { return v == 1; });
+    }
+};
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "parallel.h"
+
+// Coroutines need C++20; without them, none of this is compiled.
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define GRAPHICS_HAVE_COROUTINES
+#endif
+#endif
+
+#ifdef GRAPHICS_HAVE_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace graphics
+{
+	// Coroutines on the thread pools. An async::Task<T> is a coroutine that produces a T. It doesn't start
+	// until it's co_awaited (or passed to SyncWait()), and then runs on whichever thread awaited it until it
+	// co_awaits something itself:
+	// - Schedule(), which continues it on a worker of the current (or a given) thread pool,
+	// - a Future, which continues it once the Future is ready without blocking the thread in between,
+	// - another async::Task, or WhenAll() of a number of them, which run concurrently.
+	// For example, a loader can co_await a file read on a background pool, then a decode and a MIP map build
+	// spawned as tasks, and thousands of them can be in flight at once while holding on to no thread.
+	namespace async
+	{
+		template <typename T = void>
+		class Task;
+
+		class TaskPromiseBase
+		{
+		public:
+			// Once the coroutine has finished, carry on straight away with the one that awaited it, if any.
+			struct FinalAwaiter
+			{
+				bool await_ready() const noexcept { return false; }
+				template <typename Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept
+				{
+					std::coroutine_handle<> continuation = handle.promise().continuation;
+					return continuation ? continuation : std::noop_coroutine();
+				}
+				void await_resume() const noexcept {}
+			};
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			FinalAwaiter final_suspend() const noexcept { return {}; }
+			// Errors are reported with asserts here, not exceptions.
+			void unhandled_exception() const { std::terminate(); }
+
+			std::coroutine_handle<> continuation;
+		};
+
+		template <typename T>
+		class TaskPromise : public TaskPromiseBase
+		{
+		public:
+			Task<T> get_return_object();
+			template <typename U>
+			void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+			std::optional<T> value;
+		};
+
+		template <>
+		class TaskPromise<void> : public TaskPromiseBase
+		{
+		public:
+			Task<void> get_return_object();
+			void return_void() const {}
+		};
+
+		template <typename T>
+		class Task
+		{
+		public:
+			using promise_type = TaskPromise<T>;
+
+			Task(Task&& task) noexcept : handle{ std::exchange(task.handle, {}) } {}
+			Task& operator=(Task&& task) noexcept
+			{
+				if (handle) handle.destroy();
+				handle = std::exchange(task.handle, {});
+				return *this;
+			}
+			~Task()
+			{
+				if (handle) handle.destroy();
+			}
+
+			// Starts the task on the awaiting thread; the awaiting coroutine continues with its result once it
+			// has finished.
+			auto operator co_await() && noexcept
+			{
+				struct Awaiter
+				{
+					std::coroutine_handle<promise_type> handle;
+
+					bool await_ready() const noexcept { return false; }
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept
+					{
+						handle.promise().continuation = awaiting;
+						return handle;
+					}
+					T await_resume() const
+					{
+						if constexpr (!std::is_void_v<T>) return std::move(*handle.promise().value);
+					}
+				};
+				assert(handle);
+				return Awaiter{ handle };
+			}
+
+		private:
+			friend class TaskPromise<T>;
+			explicit Task(std::coroutine_handle<promise_type> handle) : handle{ handle } {}
+
+			std::coroutine_handle<promise_type> handle;
+		};
+
+		template <typename T>
+		Task<T> TaskPromise<T>::get_return_object()
+		{
+			return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+		}
+
+		inline Task<void> TaskPromise<void>::get_return_object()
+		{
+			return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+		}
+
+		// co_await Schedule() continues the coroutine on a worker of 'pool', or of the current thread's pool
+		// if it's null (see ThreadPoolScope). Without worker threads, the coroutine just carries on.
+		class ScheduleAwaiter
+		{
+		public:
+			explicit ScheduleAwaiter(ThreadPool* pool) : pool{ pool } {}
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) const
+			{
+				ThreadPoolScope scope(pool ? pool : CurrentThreadPool());
+				// The coroutine may be resumed, and finish, before SpawnTask() even returns, so nothing that
+				// belongs to it may be touched after this.
+				SpawnTask([handle]() { handle.resume(); });
+			}
+			void await_resume() const noexcept {}
+
+		private:
+			ThreadPool* pool;
+		};
+
+		inline ScheduleAwaiter Schedule(ThreadPool* pool = nullptr)
+		{
+			return ScheduleAwaiter(pool);
+		}
+
+		// Continues the awaiting coroutine as a task that depends on the Future's, so that no thread waits for
+		// it in the meantime.
+		template <typename T>
+		class FutureAwaiter
+		{
+		public:
+			explicit FutureAwaiter(Future<T> future) : future{ std::move(future) } {}
+			bool await_ready() const { return future.IsReady(); }
+			void await_suspend(std::coroutine_handle<> handle) const
+			{
+				SpawnTask([handle]() { handle.resume(); }, { future.task });
+			}
+			T await_resume() const
+			{
+				if constexpr (std::is_void_v<T>)
+					future.Get();
+				else
+					return future.Get();
+			}
+
+		private:
+			Future<T> future;
+		};
+
+		// A coroutine that starts right away and cleans up after itself; used to run the tasks passed to
+		// SyncWait() and WhenAll().
+		struct DetachedCoroutine
+		{
+			struct promise_type
+			{
+				DetachedCoroutine get_return_object() const noexcept { return {}; }
+				std::suspend_never initial_suspend() const noexcept { return {}; }
+				std::suspend_never final_suspend() const noexcept { return {}; }
+				void return_void() const noexcept {}
+				void unhandled_exception() const { std::terminate(); }
+			};
+		};
+
+		class SyncWaitEvent
+		{
+		public:
+			void Set()
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				done = true;
+				cv.notify_all();
+			}
+			void Wait()
+			{
+				std::unique_lock<std::mutex> lock{ mutex };
+				cv.wait(lock, [this]() { return done; });
+			}
+
+		private:
+			std::mutex mutex;
+			std::condition_variable cv;
+			bool done = false;
+		};
+
+		template <typename T>
+		DetachedCoroutine runAndSignal(Task<T>& task, std::optional<T>* result, SyncWaitEvent* event)
+		{
+			result->emplace(co_await std::move(task));
+			event->Set();
+		}
+
+		inline DetachedCoroutine runAndSignal(Task<void>& task, std::optional<bool>*, SyncWaitEvent* event)
+		{
+			co_await std::move(task);
+			event->Set();
+		}
+
+		// Runs 'task' and blocks the calling thread, typically the main thread, until it has finished; then
+		// returns its result. The task runs on the calling thread until it first moves to a pool's workers.
+		template <typename T>
+		T SyncWait(Task<T> task)
+		{
+			SyncWaitEvent event;
+			std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+			runAndSignal(task, &result, &event);
+			event.Wait();
+			if constexpr (!std::is_void_v<T>) return std::move(*result);
+		}
+
+		// Counts down the tasks of a WhenAll(). It starts out one higher than the number of tasks, for the
+		// coroutine that waits on them, so that whoever brings it to zero knows that the others are done, and
+		// that the waiting coroutine has suspended, or else isn't going to.
+		class WhenAllLatch
+		{
+		public:
+			explicit WhenAllLatch(size_t count) : remaining{ count + 1 } {}
+
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> handle) noexcept
+			{
+				waiting = handle;
+				return --remaining > 0;
+			}
+			void await_resume() const noexcept {}
+
+			void Arrive()
+			{
+				if (--remaining == 0) waiting.resume();
+			}
+
+		private:
+			std::atomic<size_t> remaining;
+			std::coroutine_handle<> waiting;
+		};
+
+		template <typename T>
+		DetachedCoroutine runWhenAllTask(Task<T>& task, std::optional<T>* result, WhenAllLatch* latch)
+		{
+			co_await Schedule();
+			result->emplace(co_await std::move(task));
+			latch->Arrive();
+		}
+
+		inline DetachedCoroutine runWhenAllTask(Task<void>& task, WhenAllLatch* latch)
+		{
+			co_await Schedule();
+			co_await std::move(task);
+			latch->Arrive();
+		}
+
+		// Runs all of the tasks concurrently, each one starting on a worker of the current thread's pool, and
+		// returns their results in order once they've all finished.
+		template <typename T>
+		Task<std::vector<T>> WhenAll(std::vector<Task<T>> tasks)
+		{
+			std::vector<std::optional<T>> results(tasks.size());
+			WhenAllLatch latch(tasks.size());
+			for (size_t i = 0; i < tasks.size(); ++i) runWhenAllTask(tasks[i], &results[i], &latch);
+			co_await latch;
+
+			std::vector<T> values;
+			values.reserve(results.size());
+			for (std::optional<T>& result : results) values.push_back(std::move(*result));
+			co_return values;
+		}
+
+		inline Task<void> WhenAll(std::vector<Task<void>> tasks)
+		{
+			WhenAllLatch latch(tasks.size());
+			for (Task<void>& task : tasks) runWhenAllTask(task, &latch);
+			co_await latch;
+		}
+	} // namespace async
+
+	// Lets coroutines co_await a Future.
+	template <typename T>
+	async::FutureAwaiter<T> operator co_await(const Future<T>& future)
+	{
+		return async::FutureAwaiter<T>(future);
+	}
+
+} // namespace graphics
+
+#endif // GRAPHICS_HAVE_COROUTINES
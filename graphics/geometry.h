@@ -859,6 +859,143 @@ namespace graphics {
 		const Bounds2i* bounds;
 	};
 
+	// Space-filling curves map an index d in [0, side * side), where side is a power of two, to a point in
+	// [0, side)^2 such that points with nearby indices are also close together in the plane.
+	enum class SpaceFillingCurve { Morton, Hilbert };
+
+	// Morton (Z-order) curve: x and y are the even and odd bits of d respectively.
+	inline int32_t CompactBy1(uint32_t x)
+	{
+		x &= 0x55555555;
+		x = (x ^ (x >> 1)) & 0x33333333;
+		x = (x ^ (x >> 2)) & 0x0f0f0f0f;
+		x = (x ^ (x >> 4)) & 0x00ff00ff;
+		x = (x ^ (x >> 8)) & 0x0000ffff;
+		return x;
+	}
+	inline Point2i MortonToPoint(uint32_t d) { return Point2i{ CompactBy1(d), CompactBy1(d >> 1) }; }
+
+	// Hilbert curve; unlike the Morton curve, consecutive indices are always adjacent points.
+	inline Point2i HilbertToPoint(int side, uint32_t d)
+	{
+		int x = 0, y = 0;
+		for (int s = 1; s < side; s *= 2)
+		{
+			int rx = 1 & (d / 2);
+			int ry = 1 & (d ^ rx);
+			// Rotate the quadrant so the sub-curve joins up with its neighbours
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			d /= 4;
+		}
+		return Point2i{ x, y };
+	}
+
+	inline Point2i CurveToPoint(SpaceFillingCurve curve, int side, uint32_t d)
+	{
+		return (curve == SpaceFillingCurve::Morton) ? MortonToPoint(d) : HilbertToPoint(side, d);
+	}
+
+	// The side of the square blocks that a curve covers an extent with: the largest power of two that fits in
+	// its shorter side, so that no block sticks out of the extent in both directions.
+	inline int CurveBlockSide(const Vector2i& extent)
+	{
+		return 1 << Log2Int(uint64_t(std::max(1, std::min(extent.x, extent.y))));
+	}
+
+	// Visits the points of a Bounds2i in space-filling curve order rather than Bounds2iIterator's scanline order.
+	// The bounds are covered with square blocks as large as its shorter side allows; blocks are visited in
+	// scanline order and the points in each block along the curve, skipping those that fall outside the bounds.
+	class Bounds2iCurveIterator : public std::forward_iterator_tag
+	{
+	public:
+		Bounds2iCurveIterator(const Bounds2i& b, SpaceFillingCurve curve, bool atEnd = false)
+			: bounds{ &b }, curve{ curve }
+		{
+			Vector2i extent = b.pMax - b.pMin;
+			side = CurveBlockSide(extent);
+			nBlocksX = (extent.x + side - 1) / side;
+			nBlocks = (extent.x <= 0 || extent.y <= 0) ? 0 : nBlocksX * ((extent.y + side - 1) / side);
+			block = atEnd ? nBlocks : 0;
+			if (block < nBlocks)
+			{
+				p = curvePoint();
+				if (!Inside(p)) advance();
+			}
+		}
+		Bounds2iCurveIterator operator++()
+		{
+			advance();
+			return *this;
+		}
+		Bounds2iCurveIterator operator++(int)
+		{
+			Bounds2iCurveIterator old = *this;
+			advance();
+			return old;
+		}
+		bool operator==(const Bounds2iCurveIterator& bi) const
+		{
+			return block == bi.block && d == bi.d && bounds == bi.bounds;
+		}
+		bool operator!=(const Bounds2iCurveIterator& bi) const
+		{
+			return !(*this == bi);
+		}
+		Point2i operator*() const { return p; }
+
+	private:
+		bool Inside(const Point2i& pt) const
+		{
+			return pt.x < bounds->pMax.x && pt.y < bounds->pMax.y;
+		}
+		Point2i curvePoint() const
+		{
+			Point2i pc = CurveToPoint(curve, side, d);
+			return Point2i{ bounds->pMin.x + (block % nBlocksX) * side + pc.x,
+							bounds->pMin.y + (block / nBlocksX) * side + pc.y };
+		}
+		void advance()
+		{
+			do
+			{
+				if (++d == (uint32_t)(side * side))
+				{
+					d = 0;
+					if (++block == nBlocks) return;
+				}
+				p = curvePoint();
+			} while (!Inside(p));
+		}
+		const Bounds2i* bounds;
+		SpaceFillingCurve curve;
+		int side, nBlocksX, nBlocks, block;
+		uint32_t d = 0;
+		Point2i p;
+	};
+
+	// Range over a Bounds2i in curve order, for use with range-based for loops.
+	class Bounds2iCurve
+	{
+	public:
+		Bounds2iCurve(const Bounds2i& b, SpaceFillingCurve curve) : bounds{ b }, curve{ curve } {}
+		Bounds2iCurveIterator begin() const { return Bounds2iCurveIterator(bounds, curve); }
+		Bounds2iCurveIterator end() const { return Bounds2iCurveIterator(bounds, curve, true); }
+
+	private:
+		const Bounds2i& bounds;
+		SpaceFillingCurve curve;
+	};
+
 	// Geometry inline functions
 	// TODO: there may be glaring bugs in here!
 
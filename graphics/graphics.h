@@ -14,6 +14,9 @@
 #include <vector>
 #include <algorithm>
 #include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #pragma warning(disable : 4305)  // double constant assigned to float
 #pragma warning(disable : 4244)  // int -> float conversion
@@ -23,6 +26,7 @@
 
 // Global macros
 #define ALLOCA(TYPE, COUNT) (TYPE*) alloca((COUNT) * sizeof(TYPE))
+#define GRAPHICS_THREAD_LOCAL thread_local
 
 namespace graphics
 {
@@ -105,6 +109,10 @@ namespace graphics
 	typedef float Float;
 #endif // GRAPHICS_FLOAT_AS_DOUBLE
 
+	// How ParallelInit() pins threads to logical processors. Compact fills up one NUMA node before moving on
+	// to the next, Scatter deals threads out to the nodes in turn, and List uses Options::threadProcessors.
+	enum class ThreadAffinity { None, Compact, Scatter, List };
+
 	struct Options
 	{
 		Options()
@@ -115,6 +123,28 @@ namespace graphics
 			cropWindow[1][1] = 1;
 		}
 		int nThreads = 0;
+		ThreadAffinity threadAffinity = ThreadAffinity::None;
+		// With ThreadAffinity::List, the logical processor for each thread, by ThreadIndex (repeating if
+		// there are more threads than entries). Processors past the first 64 are numbered 64 * group + index.
+		std::vector<int> threadProcessors;
+		// If set, the logical processors of each NUMA node, to use in place of what the system reports.
+		std::vector<std::vector<int>> numaNodes;
+		// If set, ParallelInit() opens this file, and every parallel loop writes out a line per chunk to it: which
+		// thread ran which iterations, and when.
+		std::string loopTraceFile;
+		// Makes results independent of how work happens to be spread over the threads, and of their number,
+		// so that runs can be compared bit for bit: parallel loops hand their bodies the same chunks whatever
+		// the scheduling, and SplatBuffer sums in a fixed order. Reductions and scans always do. AtomicFloat,
+		// PerThread and anything else keyed by thread stay nondeterministic.
+		bool deterministic = false;
+		// Samples per second of CPU time that the profiler takes in each thread, where it's supported.
+		int profileSampleRate = 100;
+		// Has the profiler also read hardware counters in each thread (cycles, instructions, last-level cache
+		// and branch misses) and charge them to the categories that are active when it samples.
+		bool profileCounters = false;
+		// If set, CleanupProfiler() writes a timeline of the profiler categories in each thread to this file,
+		// in the Chrome trace format that chrome://tracing and Perfetto read.
+		std::string profileTraceFile;
 		bool quickRender = false;
 		bool quiet = false;
 		bool cat = false, toPly = false;
@@ -173,4 +203,36 @@ namespace graphics
 	{
 		return (n * MachineEpsilon) / (1 - n * MachineEpsilon);
 	}
+	// The index of the highest set bit; v must be non-zero.
+	inline int Log2Int(uint64_t v)
+	{
+#ifdef _MSC_VER
+		unsigned long index = 0;
+		_BitScanReverse64(&index, v);
+		return index;
+#else
+		return 63 - __builtin_clzll(v);
+#endif
+	}
+	inline int32_t RoundUpPow2(int32_t v)
+	{
+		--v;
+		v |= v >> 1;
+		v |= v >> 2;
+		v |= v >> 4;
+		v |= v >> 8;
+		v |= v >> 16;
+		return v + 1;
+	}
+	inline int64_t RoundUpPow2(int64_t v)
+	{
+		--v;
+		v |= v >> 1;
+		v |= v >> 2;
+		v |= v >> 4;
+		v |= v >> 8;
+		v |= v >> 16;
+		v |= v >> 32;
+		return v + 1;
+	}
 } // namespace graphics
\ No newline at end of file
@@ -0,0 +1,324 @@
+#pragma once
+
+#include "graphics.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace graphics
+{
+	// Concurrent hash maps for caches that are filled in while rendering, such as a grid of SPPM visible
+	// points, per-voxel light distributions or texture tiles. Keys are 64-bit integers, into which callers pack
+	// whatever identifies an entry (voxel coordinates, a texture and tile number, ...); the two largest values
+	// are reserved. Finding an entry takes no locks and writes to no shared memory. Inserting one claims a slot
+	// with a compare-exchange on its key, and other threads that look for the key meanwhile wait for its value.
+	// Entries can't be changed or removed once inserted, and pointers to their values stay valid for as long
+	// as the map. Values must be default-constructible and copy-assignable.
+
+	// Scrambles the bits of a key so that keys that differ only in a few bits, like packed coordinates, don't
+	// end up in neighbouring slots.
+	inline uint64_t MixBits(uint64_t v)
+	{
+		v ^= (v >> 31);
+		v *= 0x7fb5d329728ea185ull;
+		v ^= (v >> 27);
+		v *= 0x81dadef4bc2dd44dull;
+		v ^= (v >> 33);
+		return v;
+	}
+
+	// The open-addressing table with linear probing behind both maps.
+	template <typename Value>
+	class ConcurrentHashTable
+	{
+	public:
+		static constexpr uint64_t EmptyKey = ~uint64_t(0);
+		// Marks the free slots of a table that's being replaced by a larger one; see GrowableConcurrentHashMap.
+		static constexpr uint64_t MovedKey = ~uint64_t(0) - 1;
+
+		struct Slot
+		{
+			std::atomic<uint64_t> key{ EmptyKey };
+			// Set once value has been written.
+			std::atomic<bool> ready{ false };
+			Value value;
+
+			void WaitUntilReady() const
+			{
+				while (!ready.load(std::memory_order_acquire)) std::this_thread::yield();
+			}
+		};
+
+		enum class ClaimResult { Claimed, Found, Moved, Full };
+
+		explicit ConcurrentHashTable(int64_t nSlots)
+			: nSlots{ RoundUpPow2(std::max(nSlots, (int64_t)2)) }, slots(new Slot[this->nSlots])
+		{}
+
+		int64_t Slots() const { return nSlots; }
+		int64_t Size() const { return size.load(std::memory_order_relaxed); }
+
+		// Returns the slot that holds key, once its value is ready, or null if there isn't one. *moved is set if
+		// the search ran into a slot that a resize has closed, in which case the key may be in the next table.
+		const Slot* Find(uint64_t key, bool* moved) const
+		{
+			for (int64_t i = 0, index = start(key); i < nSlots; ++i, index = (index + 1) & (nSlots - 1))
+			{
+				uint64_t k = slots[index].key.load(std::memory_order_acquire);
+				if (k == key)
+				{
+					slots[index].WaitUntilReady();
+					return &slots[index];
+				}
+				if (k == EmptyKey) return nullptr;
+				if (k == MovedKey)
+				{
+					*moved = true;
+					return nullptr;
+				}
+			}
+			return nullptr;
+		}
+
+		// Finds the slot that holds key, or claims the first free one on its probe sequence for it, in which case
+		// the caller must Publish() its value.
+		ClaimResult Claim(uint64_t key, Slot** slot)
+		{
+			assert(key != EmptyKey && key != MovedKey);
+			for (int64_t i = 0, index = start(key); i < nSlots; ++i, index = (index + 1) & (nSlots - 1))
+			{
+				Slot& s = slots[index];
+				uint64_t k = s.key.load(std::memory_order_acquire);
+				if (k == EmptyKey && s.key.compare_exchange_strong(k, key, std::memory_order_acq_rel))
+				{
+					size.fetch_add(1, std::memory_order_relaxed);
+					*slot = &s;
+					return ClaimResult::Claimed;
+				}
+				// k now holds whatever key the slot has, whether or not another thread just got there first.
+				if (k == key)
+				{
+					s.WaitUntilReady();
+					*slot = &s;
+					return ClaimResult::Found;
+				}
+				if (k == MovedKey) return ClaimResult::Moved;
+			}
+			return ClaimResult::Full;
+		}
+
+		static void Publish(Slot* slot, const Value& value)
+		{
+			slot->value = value;
+			slot->ready.store(true, std::memory_order_release);
+		}
+
+		// Closes the slot at 'index' if it's free and returns true; otherwise waits for its value.
+		bool Close(int64_t index)
+		{
+			uint64_t k = EmptyKey;
+			if (slots[index].key.compare_exchange_strong(k, MovedKey, std::memory_order_acq_rel)) return true;
+			slots[index].WaitUntilReady();
+			return false;
+		}
+
+		const Slot& operator[](int64_t index) const { return slots[index]; }
+
+		// The table that replaces this one, once it has started growing.
+		std::atomic<ConcurrentHashTable*> next{ nullptr };
+
+	private:
+		int64_t start(uint64_t key) const { return MixBits(key) & (nSlots - 1); }
+
+		const int64_t nSlots;
+		std::unique_ptr<Slot[]> slots;
+		std::atomic<int64_t> size{ 0 };
+	};
+
+	// A map with room for a number of entries given up front, for when that's known, e.g. from the number of
+	// voxels in a grid.
+	template <typename Value>
+	class ConcurrentHashMap
+	{
+		typedef ConcurrentHashTable<Value> Table;
+
+	public:
+		// The map holds at least 'capacity' entries; lookups stay short until then, since it has twice as many
+		// slots.
+		explicit ConcurrentHashMap(int64_t capacity) : table(2 * capacity) {}
+
+		int64_t Size() const { return table.Size(); }
+		int64_t Capacity() const { return table.Slots(); }
+
+		const Value* Find(uint64_t key) const
+		{
+			bool moved = false;
+			const typename Table::Slot* slot = table.Find(key, &moved);
+			return slot ? &slot->value : nullptr;
+		}
+
+		// Returns the value for key, calling create() for it if the key isn't in the map yet. When threads ask
+		// for the same new key at once, create() is called by just one of them and the others wait for it, so
+		// it mustn't insert into this map itself. Returns null only if the map is full.
+		template <typename F>
+		const Value* FindOrInsert(uint64_t key, F&& create)
+		{
+			typename Table::Slot* slot;
+			switch (table.Claim(key, &slot))
+			{
+			case Table::ClaimResult::Claimed:
+				Table::Publish(slot, create());
+				return &slot->value;
+			case Table::ClaimResult::Found:
+				return &slot->value;
+			default:
+				assert(!"ConcurrentHashMap is full");
+				return nullptr;
+			}
+		}
+
+		// Returns false if the key was already in the map, in which case its value is left as it was.
+		bool Insert(uint64_t key, const Value& value)
+		{
+			bool inserted = false;
+			FindOrInsert(key, [&]()
+				{
+					inserted = true;
+					return value;
+				});
+			return inserted;
+		}
+
+		// Calls func(key, value) for each entry. Must not be called while any thread might be inserting.
+		template <typename F>
+		void ForEach(F&& func) const
+		{
+			for (int64_t i = 0; i < table.Slots(); ++i)
+			{
+				uint64_t key = table[i].key.load(std::memory_order_relaxed);
+				if (key != Table::EmptyKey) func(key, table[i].value);
+			}
+		}
+
+	private:
+		Table table;
+	};
+
+	// A map that doubles its number of slots whenever it's half full. Growing is done by the thread whose insert
+	// crossed the threshold: it closes the free slots of the old table, so that no new key can go there, and
+	// copies the entries into the new one. Lookups carry on meanwhile, going on to the new table when they
+	// run into a closed slot, while inserts wait for the copying to finish. The old tables are kept until the
+	// map is destroyed, both so that lookups that are still in them can finish and so that pointers to their
+	// values stay valid; that at most doubles the memory used, since each table is twice the size of the last.
+	template <typename Value>
+	class GrowableConcurrentHashMap
+	{
+		typedef ConcurrentHashTable<Value> Table;
+
+	public:
+		explicit GrowableConcurrentHashMap(int64_t initialCapacity = 64)
+		{
+			tables.push_back(std::unique_ptr<Table>(new Table(2 * initialCapacity)));
+			current.store(tables.back().get(), std::memory_order_release);
+		}
+
+		int64_t Size() const { return current.load(std::memory_order_acquire)->Size(); }
+		int64_t Capacity() const { return current.load(std::memory_order_acquire)->Slots(); }
+
+		const Value* Find(uint64_t key) const
+		{
+			for (const Table* table = current.load(std::memory_order_acquire); table;
+				 table = table->next.load(std::memory_order_acquire))
+			{
+				bool moved = false;
+				const typename Table::Slot* slot = table->Find(key, &moved);
+				if (slot) return &slot->value;
+				if (!moved) return nullptr;
+			}
+			return nullptr;
+		}
+
+		// As ConcurrentHashMap::FindOrInsert(), but never fails. create() mustn't insert into this map, since a
+		// thread that's growing it waits for the values of all of the slots that have been claimed.
+		template <typename F>
+		const Value* FindOrInsert(uint64_t key, F&& create)
+		{
+			while (true)
+			{
+				Table* table = current.load(std::memory_order_acquire);
+				typename Table::Slot* slot;
+				switch (table->Claim(key, &slot))
+				{
+				case Table::ClaimResult::Claimed:
+					Table::Publish(slot, create());
+					if (table->Size() > table->Slots() / 2) grow(table);
+					return &slot->value;
+				case Table::ClaimResult::Found:
+					return &slot->value;
+				default:
+					// The table is being replaced, or has filled up before it could be; either way, wait for
+					// (or do) the growing and try again in the new table.
+					grow(table);
+					break;
+				}
+			}
+		}
+
+		bool Insert(uint64_t key, const Value& value)
+		{
+			bool inserted = false;
+			FindOrInsert(key, [&]()
+				{
+					inserted = true;
+					return value;
+				});
+			return inserted;
+		}
+
+		template <typename F>
+		void ForEach(F&& func) const
+		{
+			const Table& table = *current.load(std::memory_order_acquire);
+			for (int64_t i = 0; i < table.Slots(); ++i)
+			{
+				uint64_t key = table[i].key.load(std::memory_order_relaxed);
+				if (key != Table::EmptyKey) func(key, table[i].value);
+			}
+		}
+
+	private:
+		// Replaces 'table' with one twice the size, unless another thread already has.
+		void grow(Table* table)
+		{
+			std::lock_guard<std::mutex> lock{ growMutex };
+			if (current.load(std::memory_order_acquire) != table) return;
+
+			tables.push_back(std::unique_ptr<Table>(new Table(2 * table->Slots())));
+			Table* next = tables.back().get();
+			table->next.store(next, std::memory_order_release);
+			for (int64_t i = 0; i < table->Slots(); ++i)
+			{
+				if (table->Close(i)) continue;
+				const typename Table::Slot& from = (*table)[i];
+				typename Table::Slot* to;
+				typename Table::ClaimResult result = next->Claim(from.key.load(std::memory_order_relaxed), &to);
+				assert(result == Table::ClaimResult::Claimed);
+				Table::Publish(to, from.value);
+			}
+			current.store(next, std::memory_order_release);
+		}
+
+		std::atomic<Table*> current;
+		std::mutex growMutex;
+		// Only changed with growMutex held.
+		std::vector<std::unique_ptr<Table>> tables;
+	};
+
+	template <typename Value>
+	constexpr uint64_t ConcurrentHashTable<Value>::EmptyKey;
+	template <typename Value>
+	constexpr uint64_t ConcurrentHashTable<Value>::MovedKey;
+
+} // namespace graphics
@@ -1,310 +1,1356 @@
 #include "parallel.h"
 #include "memory.h"
 #include "stats.h"
-#include <list>
+#include <chrono>
+#include <deque>
 #include <thread>
 #include <condition_variable>
+#include <fstream>
+#include <sstream>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <intrin.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace graphics
 {
 	// Parallel local definitions
-	static std::vector<std::thread> threads;
-	static bool shutdownThreads = false;
 	class ParallelForLoop;
-	static ParallelForLoop* workList = nullptr;
-	static std::mutex workListMutex;
-	static std::condition_variable workListCondition;
 	thread_local int ThreadIndex;
+	thread_local int globalThreadIndex = -1;
+	// The pool created by ParallelInit(), the pool whose work the thread is running (or that it has been told
+	// to start its work on), and the pool that the thread is a worker of, if any.
+	static std::shared_ptr<ThreadPool> defaultPool;
+	static thread_local ThreadPool* currentPool = nullptr;
+	static thread_local ThreadPool* ownPool = nullptr;
+	// How deeply nested the loop iteration or task the thread is running is: 0 outside of any, 1 for the
+	// iterations of a loop started from there, 2 for those of a loop started inside of one of those, etc.
+	static thread_local int workDepth = 0;
 
-	// Bookkeeping variables to help with the implementation of MergeWorkerThreadStats().
-	static std::atomic<bool> reportWorkerStats{ false };
-	// Number of workers that still need to report their stats.
-	static std::atomic<int> reporterCount;
-	// After pushing the workers to report their stats, the main thread waits on this condition variable until
-	// they've all done so.
-	static std::condition_variable reportDoneCondition;
-	static std::mutex reportDoneMutex;
+	// What the current thread did for the schedulers since its stats were last reported. Busy time is spent
+	// running work, idle time looking or waiting for it, and lock wait time blocked on a queue's mutex while
+	// another thread holds it; all of them are in nanoseconds.
+	static thread_local int64_t busyNanoseconds, idleNanoseconds, lockWaitNanoseconds;
+	static thread_local int64_t nChunksRun, nIterationsRun, nRangesStolen;
+
+	static inline int64_t nanosecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	static const int chunksRunStat = StatRegisterer::RegisterStat(StatType::Counter, "Parallel/Chunks run");
+	static const int iterationsRunStat = StatRegisterer::RegisterStat(StatType::Counter, "Parallel/Iterations run");
+	static const int rangesStolenStat = StatRegisterer::RegisterStat(StatType::Counter, "Parallel/Work items stolen");
+	static const int busyTimeStat =
+		StatRegisterer::RegisterStat(StatType::FloatDistribution, "Parallel/Busy time per thread (ms)");
+	static const int idleTimeStat =
+		StatRegisterer::RegisterStat(StatType::FloatDistribution, "Parallel/Idle time per thread (ms)");
+	static const int lockWaitStat =
+		StatRegisterer::RegisterStat(StatType::FloatDistribution, "Parallel/Queue lock wait per thread (ms)");
+	static const int chunksPerThreadStat =
+		StatRegisterer::RegisterStat(StatType::IntDistribution, "Parallel/Chunks run per thread");
+	static const int busyPercentageStat =
+		StatRegisterer::RegisterStat(StatType::Percentage, "Parallel/Time spent running work");
+
+	static void reportSchedulerStats(StatsAccumulator& accum)
+	{
+		accum.ReportCounter(chunksRunStat, nChunksRun);
+		accum.ReportCounter(iterationsRunStat, nIterationsRun);
+		accum.ReportCounter(rangesStolenStat, nRangesStolen);
+		// Threads that took part report a sample each, so that the distributions show how evenly the work was
+		// spread over them.
+		if (busyNanoseconds + idleNanoseconds > 0)
+		{
+			double busy = busyNanoseconds / 1e6, idle = idleNanoseconds / 1e6, lockWait = lockWaitNanoseconds / 1e6;
+			accum.ReportFloatDistribution(busyTimeStat, busy, 1, busy, busy);
+			accum.ReportFloatDistribution(idleTimeStat, idle, 1, idle, idle);
+			accum.ReportFloatDistribution(lockWaitStat, lockWait, 1, lockWait, lockWait);
+			accum.ReportIntDistribution(chunksPerThreadStat, nChunksRun, 1, nChunksRun, nChunksRun);
+			accum.ReportPercentage(busyPercentageStat, busyNanoseconds, busyNanoseconds + idleNanoseconds);
+		}
+		busyNanoseconds = idleNanoseconds = lockWaitNanoseconds = 0;
+		nChunksRun = nIterationsRun = nRangesStolen = 0;
+	}
+
+	static StatRegisterer schedulerStatsRegisterer(reportSchedulerStats);
+
+	// A WorkItem is either a contiguous range of iterations of a ParallelForLoop that has not been run yet, or
+	// a Task whose dependencies have all finished.
+	struct WorkItem
+	{
+		ParallelForLoop* loop;
+		int64_t begin, end;
+		std::shared_ptr<Task> task;
+	};
+
+	// Every thread that takes part in running loops (the main thread included) owns a WorkQueue. The owner
+	// pushes and pops work at the back of its queue, while idle threads steal from the front, where the
+	// oldest and therefore largest ranges are. The mutex only guards one queue, so it is uncontended unless
+	// a thief happens to pick this queue as its victim. Queues are aligned so that neighbouring ones don't
+	// share cache lines.
+	class alignas(64) WorkQueue
+	{
+	public:
+		// Must be called before anything is pushed.
+		void SetNumaNodeCount(int nNodes) { pinnedSizes.reset(new std::atomic<int>[nNodes]()); }
+
+		void Push(const WorkItem& item)
+		{
+			std::unique_lock<std::mutex> lock = acquire();
+			items.push_back(item);
+			size = (int)items.size();
+			++queuedFor(item);
+		}
+		// Both take the first item, from the back or the front, that a thread on the given node that's waiting
+		// for work at least minDepth deep may run. See canRun().
+		bool Pop(WorkItem* item, int node, int minDepth);
+		bool Steal(WorkItem* item, int node, int minDepth);
+		// May be read without holding the lock. The load is sequentially consistent since workers rely on it
+		// to not miss work that was pushed just as they were going to sleep.
+		bool Empty() const { return size.load() == 0; }
+		// Whether the queue holds work that any thread may run (node -1), or work tied to the given node. Read
+		// like Empty().
+		bool HasWorkQueued(int node) const
+		{
+			return node < 0 ? unpinnedSize.load() > 0 : pinnedSizes[node].load() > 0;
+		}
+
+	private:
+		// Locks the queue, keeping track of the time spent waiting if another thread holds it.
+		std::unique_lock<std::mutex> acquire()
+		{
+			std::unique_lock<std::mutex> lock{ mutex, std::try_to_lock };
+			if (!lock.owns_lock())
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				lock.lock();
+				lockWaitNanoseconds += nanosecondsSince(start);
+			}
+			return lock;
+		}
+
+		// Must be called with the mutex held.
+		bool take(size_t index, WorkItem* item)
+		{
+			*item = std::move(items[index]);
+			items.erase(items.begin() + index);
+			size = (int)items.size();
+			--queuedFor(*item);
+			return true;
+		}
+
+		// The count that an item is included in.
+		std::atomic<int>& queuedFor(const WorkItem& item);
+
+		std::mutex mutex;
+		std::deque<WorkItem> items;
+		std::atomic<int> size{ 0 };
+		// The number of items that any thread may run, and of those tied to each NUMA node.
+		std::atomic<int> unpinnedSize{ 0 };
+		std::unique_ptr<std::atomic<int>[]> pinnedSizes;
+	};
+
+	// Returns the logical processors of each NUMA node, or RayTracerOptions.numaNodes if set. Where the
+	// topology can't be queried, all of the processors are reported as a single node.
+	static std::vector<std::vector<int>> numaNodeProcessors()
+	{
+		if (!RayTracerOptions.numaNodes.empty()) return RayTracerOptions.numaNodes;
+		std::vector<std::vector<int>> nodes;
+#ifdef _WIN32
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode))
+		{
+			for (USHORT node = 0; node <= highestNode; ++node)
+			{
+				GROUP_AFFINITY affinity;
+				if (!GetNumaNodeProcessorMaskEx(node, &affinity)) continue;
+				std::vector<int> processors;
+				for (int bit = 0; bit < 64; ++bit)
+					if (affinity.Mask & (KAFFINITY(1) << bit)) processors.push_back(64 * affinity.Group + bit);
+				if (!processors.empty()) nodes.push_back(processors);
+			}
+		}
+#elif defined(__linux__)
+		for (int node = 0;; ++node)
+		{
+			// cpulist holds comma-separated processor numbers and ranges, e.g. "0-15,32-47".
+			std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!in) break;
+			std::vector<int> processors;
+			std::string range;
+			while (std::getline(in, range, ','))
+			{
+				int first, last;
+				char dash;
+				std::istringstream rs(range);
+				if (!(rs >> first)) continue;
+				last = (rs >> dash >> last) ? last : first;
+				for (int p = first; p <= last; ++p) processors.push_back(p);
+			}
+			if (!processors.empty()) nodes.push_back(processors);
+		}
+#endif
+		if (nodes.empty())
+		{
+			nodes.push_back(std::vector<int>());
+			for (int p = 0; p < NumSystemCores(); ++p) nodes[0].push_back(p);
+		}
+		return nodes;
+	}
+
+	static bool pinCurrentThread(int processor)
+	{
+#ifdef _WIN32
+		GROUP_AFFINITY affinity = {};
+		affinity.Group = WORD(processor / 64);
+		affinity.Mask = KAFFINITY(1) << (processor % 64);
+		return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(processor, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
+	static bool setCurrentThreadPriority(ThreadPriority priority)
+	{
+#ifdef _WIN32
+		int level = priority == ThreadPriority::Background ? THREAD_PRIORITY_BELOW_NORMAL :
+			priority == ThreadPriority::Interactive ? THREAD_PRIORITY_ABOVE_NORMAL : THREAD_PRIORITY_NORMAL;
+		return SetThreadPriority(GetCurrentThread(), level) != 0;
+#elif defined(__linux__)
+		// Nice values apply to individual threads on Linux. Raising the priority takes privileges; without
+		// them the thread just keeps running at the normal priority.
+		int nice = priority == ThreadPriority::Background ? 10 : priority == ThreadPriority::Interactive ? -5 : 0;
+		return setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) == 0;
+#else
+		return false;
+#endif
+	}
+
+	static inline void cpuPause()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	STAT_INT_DISTRIBUTION("Parallel/Iterations per loop", iterationsPerLoop);
+	STAT_COUNTER("Parallel/Loops with automatic chunk size", nAutoChunkLoops);
+	STAT_INT_DISTRIBUTION("Parallel/Chunks per automatically chunked loop", chunksPerAutoLoop);
+	STAT_INT_DISTRIBUTION("Parallel/Iterations per automatically sized chunk", iterationsPerAutoChunk);
+	STAT_FLOAT_DISTRIBUTION("Parallel/Measured cost per loop iteration (ns)", autoLoopIterationCost);
+	STAT_COUNTER("Parallel/Work found while spinning", nSpinWakeups);
+	STAT_COUNTER("Parallel/Worker sleeps", nWorkerSleeps);
+	STAT_COUNTER("Parallel/Tiles split for their cost", nTilesSplit);
+
+	// With AutoChunkSize, chunks are never made so small that they would take less than this long to run,
+	// which keeps the scheduling overhead to a few percent of the loop's run time.
+	static constexpr double minAutoChunkNanoseconds = 50000.;
+
+	// With Options::deterministic, loops with AutoChunkSize are cut into about this many chunks, however many
+	// threads there are; enough to keep a few dozen threads balanced.
+	static constexpr int64_t deterministicAutoChunks = 512;
+
+	// Roughly tens of microseconds of pause instructions.
+	static constexpr int maxIdleSpins = 4096;
+
+	// With Options::loopTraceFile set, every chunk of every loop is written out to it once the loop has
+	// finished, so that it can be seen how the iterations were spread over the threads and over time.
+	static FILE* loopTraceFile = nullptr;
+	static std::mutex loopTraceMutex;
+	static int64_t nTracedLoops = 0;
+
+	struct ChunkTrace
+	{
+		int threadIndex;
+		int64_t begin, end;
+		// Since the start of the loop.
+		int64_t startNanoseconds, endNanoseconds;
+	};
 
 	class ParallelForLoop
 	{
 	public:
-		ParallelForLoop(std::function<void(int64_t)> func1D, int64_t maxIndex, int chunkSize, uint64_t profilerState)
-			: func1D{ std::move(func1D) }, maxIndex{ maxIndex }, chunkSize{ chunkSize }, profilerState{ profilerState }
-		{}
-		ParallelForLoop(const std::function<void(Point2i)>& func2D, const Point2i& count, uint64_t profilerState)
-			: func2D{ func2D }, maxIndex{ count.x * count.y }, chunkSize{ 1 }, profilerState{ profilerState }
+		ParallelForLoop(ThreadPool* pool, const std::function<void(int64_t, int64_t)>& func, int64_t begin, int64_t end,
+			int chunkSize, int numaNode, const CancellationToken* cancel, uint64_t profilerState, bool deterministic)
+			: pool{ pool }, func{ func }, begin{ begin }, end{ end }, chunkSize{ chunkSize }, numaNode{ numaNode },
+			  depth{ workDepth + 1 }, cancel{ cancel }, profilerState{ profilerState }, deterministic{ deterministic },
+			  remaining{ end - begin }, traced{ loopTraceFile != nullptr }, startTime{ std::chrono::steady_clock::now() }
 		{
-			nX = count.x;
+			assert(!deterministic || !AutoChunked());
 		}
 
 	public:
-		std::function<void(int64_t)> func1D;
-		std::function<void(Point2i)> func2D;
-		const int64_t maxIndex;
+		ThreadPool* const pool;
+		const std::function<void(int64_t, int64_t)>& func;
+		const int64_t begin, end;
 		const int chunkSize;
+		// The node whose threads run the loop, or -1 if any thread may.
+		const int numaNode;
+		const int depth;
+		// Null unless the loop can be cancelled.
+		const CancellationToken* cancel;
 		uint64_t profilerState;
-		int64_t nextIndex = 0;
-		int activeWorkers = 0;
-		ParallelForLoop* next = nullptr;
-		int nX = -1;
+		// With Options::deterministic, func is called for exactly the chunks begin + k * chunkSize, one at a time.
+		const bool deterministic;
+		// Number of iterations that haven't finished running (or been skipped) yet, and the number that were
+		// skipped because the loop was cancelled.
+		std::atomic<int64_t> remaining;
+		std::atomic<int64_t> skipped{ 0 };
+		// With AutoChunkSize: the smallest chunk worth handing out given the measured cost of an iteration, and
+		// the number of chunks that have been run.
+		std::atomic<int64_t> minChunkSize{ 1 };
+		std::atomic<int> nChunks{ 0 };
+		// The chunks that have been run, if the loop is being traced.
+		const bool traced;
+		const std::chrono::steady_clock::time_point startTime;
+		std::mutex traceMutex;
+		std::vector<ChunkTrace> trace;
 
 		bool Finished() const
 		{
-			return nextIndex >= maxIndex && activeWorkers == 0;
+			return remaining.load(std::memory_order_acquire) == 0;
+		}
+
+		bool AutoChunked() const { return chunkSize == AutoChunkSize; }
+
+		bool Cancelled() const { return cancel && cancel->IsCancelled(); }
+
+		// The length below which a range isn't split any further. With AutoChunkSize this is guided
+		// scheduling: a fraction of what's left of the loop for each thread, so chunks start out large and
+		// shrink as the loop nears its end, but never below minChunkSize.
+		int64_t ChunkSize(int nThreads) const
+		{
+			if (!AutoChunked()) return chunkSize;
+			int64_t guided = remaining.load(std::memory_order_relaxed) / (2 * nThreads);
+			return std::max(minChunkSize.load(std::memory_order_relaxed), guided);
+		}
+
+		// Run loop indices in [indexStart, indexEnd) with a single call and record their completion. Note that
+		// the loop may be destroyed by the thread that started it as soon as the last iteration has been recorded.
+		void Run(int64_t indexStart, int64_t indexEnd)
+		{
+			uint64_t oldState = ProfilerState;
+			ProfilerState = profilerState;
+			uint64_t tracedPhases = ProfileTracing.load(std::memory_order_relaxed) ? profilerState & ~oldState : 0;
+			if (tracedPhases) TraceProfilePhases(tracedPhases, true);
+			int oldDepth = workDepth;
+			workDepth = depth;
+			ThreadPool* oldPool = currentPool;
+			currentPool = pool;
+			int64_t n = indexEnd - indexStart;
+			++nChunksRun;
+			nIterationsRun += n;
+			if (!AutoChunked() && !traced)
+				func(indexStart, indexEnd);
+			else
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				func(indexStart, indexEnd);
+				std::chrono::steady_clock::time_point finish = std::chrono::steady_clock::now();
+				if (AutoChunked())
+				{
+					double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+					double nsPerIteration = std::max(ns, 1.) / n;
+					minChunkSize.store(std::max((int64_t)1, (int64_t)(minAutoChunkNanoseconds / nsPerIteration)),
+						std::memory_order_relaxed);
+					++nChunks;
+					ReportValue(iterationsPerAutoChunk, n);
+					ReportValue(autoLoopIterationCost, nsPerIteration);
+				}
+				if (traced)
+				{
+					std::lock_guard<std::mutex> lock{ traceMutex };
+					trace.push_back(ChunkTrace{ ThreadIndex, indexStart, indexEnd,
+						std::chrono::duration_cast<std::chrono::nanoseconds>(start - startTime).count(),
+						std::chrono::duration_cast<std::chrono::nanoseconds>(finish - startTime).count() });
+				}
+			}
+			if (tracedPhases) TraceProfilePhases(tracedPhases, false);
+			ProfilerState = oldState;
+			workDepth = oldDepth;
+			currentPool = oldPool;
+			remaining.fetch_sub(indexEnd - indexStart, std::memory_order_acq_rel);
+		}
+
+		// Record the indices in [indexStart, indexEnd) as done without running them.
+		void Skip(int64_t indexStart, int64_t indexEnd)
+		{
+			skipped.fetch_add(indexEnd - indexStart, std::memory_order_relaxed);
+			remaining.fetch_sub(indexEnd - indexStart, std::memory_order_acq_rel);
 		}
 	};
 
-	void Barrier::Wait()
+	class Task
 	{
-		std::unique_lock<std::mutex> lock{ mutex };
-		assert(count > 0);
-		// If it's the last thread to reach the barrier; wake up all the other threads before exiting otherwise
-		// give up the lock and wait to be notified as there are still threads that haven't reached.
-		if (--count == 0)
-			cv.notify_all();
+	public:
+		Task(ThreadPool* pool, std::function<void()> func, uint64_t profilerState)
+			: pool{ pool }, func{ std::move(func) }, profilerState{ profilerState }, depth{ workDepth + 1 }
+		{}
+
+	public:
+		// The pool it was spawned on, if any. Without worker threads there, it's run by whichever thread
+		// finishes the last of its dependencies.
+		ThreadPool* const pool;
+		std::function<void()> func;
+		uint64_t profilerState;
+		const int depth;
+		// Number of unfinished tasks this one is waiting for, plus one that SpawnTask() holds on to while it's
+		// registering the task with them.
+		std::atomic<int> pendingDependencies{ 1 };
+		std::atomic<bool> finished{ false };
+		// Guards finished being set and the list of tasks that depend on this one.
+		std::mutex mutex;
+		std::vector<std::shared_ptr<Task>> dependents;
+	};
+
+	// A thread that's waiting for a loop to finish only helps with work that's nested at least as deeply as
+	// the loop: the loop's own iterations and whatever they start, or the iterations of another loop at the
+	// same level. Taking on an outer loop's iterations instead could start yet another inner loop and wait on
+	// that, so that the stack would grow with the number of outer iterations, and the loop the thread is
+	// really waiting for would have to wait for all of them. Limiting it like this bounds the stack by the
+	// nesting depth of the loops. Loops that are tied to a NUMA node can only be run by threads on that node.
+	static bool canRun(const WorkItem& item, int node, int minDepth)
+	{
+		if (item.task) return item.task->depth >= minDepth;
+		return item.loop->depth >= minDepth && (item.loop->numaNode < 0 || item.loop->numaNode == node);
+	}
+
+	std::atomic<int>& WorkQueue::queuedFor(const WorkItem& item)
+	{
+		return item.task || item.loop->numaNode < 0 ? unpinnedSize : pinnedSizes[item.loop->numaNode];
+	}
+
+	bool WorkQueue::Pop(WorkItem* item, int node, int minDepth)
+	{
+		if (Empty()) return false;
+		std::unique_lock<std::mutex> lock = acquire();
+		for (size_t i = items.size(); i-- > 0;)
+			if (canRun(items[i], node, minDepth)) return take(i, item);
+		return false;
+	}
+
+	bool WorkQueue::Steal(WorkItem* item, int node, int minDepth)
+	{
+		if (Empty()) return false;
+		std::unique_lock<std::mutex> lock = acquire();
+		for (size_t i = 0; i < items.size(); ++i)
+			if (canRun(items[i], node, minDepth)) return take(i, item);
+		return false;
+	}
+
+	static void runTask(const std::shared_ptr<Task>& task);
+
+	// A ThreadPool's worker threads only ever run work that was started on that pool. Queue 0 belongs to
+	// whichever threads from outside of the pool start work on it (the main thread, for the default pool)
+	// and help with it while they wait; worker i owns queue i.
+	class ThreadPool
+	{
+	public:
+		ThreadPool(int nWorkers, ThreadPriority priority, bool pinThreads);
+		~ThreadPool();
+
+		int NumThreads() const { return nWorkQueues; }
+		// Without worker threads, everything is run right away on the thread that starts it.
+		bool Serial() const { return threads.empty(); }
+		int NumaNodeCount() const { return nNumaNodes; }
+		int ThreadNumaNode(int threadIndex) const
+		{
+			return threadIndex < (int)threadNumaNode.size() ? threadNumaNode[threadIndex] : 0;
+		}
+		bool HasNumaNode(int node) const
+		{
+			return std::find(threadNumaNode.begin(), threadNumaNode.end(), node) != threadNumaNode.end();
+		}
+
+		void RunLoop(ParallelForLoop& loop);
+		void ScheduleTask(std::shared_ptr<Task> task);
+		void WaitForTask(const std::shared_ptr<Task>& task);
+		void MergeWorkerThreadStats();
+
+	private:
+		int localIndex() const { return ownPool == this ? ThreadIndex : 0; }
+		WorkQueue& localWorkQueue() { return workQueues[localIndex()]; }
+		void wakeWorker(int node);
+		void wakeWorkersForQueuedWork();
+		bool anyWorkQueued(int node) const;
+		bool anyWorkFor(int node) const { return anyWorkQueued(-1) || anyWorkQueued(node); }
+		bool stealWork(WorkItem* item, int minDepth);
+		bool findWork(WorkItem* item, int minDepth = 0);
+		void runWorkItem(WorkItem item);
+		std::vector<int> assignThreadProcessors(int nThreads);
+		void workerThreadFunc(int tIndex, int processor, std::shared_ptr<Barrier> barrier);
+
+		const ThreadPriority priority;
+		std::vector<std::thread> threads;
+		std::atomic<bool> shutdownThreads{ false };
+		std::unique_ptr<WorkQueue[]> workQueues;
+		int nWorkQueues = 0;
+
+		// The NUMA node each thread has been pinned to, by queue index, and the order in which each thread
+		// visits the other threads' queues when stealing: those on the same node first. Without pinning, all
+		// threads count as being on node 0.
+		int nNumaNodes = 1;
+		std::vector<int> threadNumaNode;
+		std::vector<std::vector<int>> stealOrder;
+
+		// A worker that runs out of work first spins for a while, watching the queues for work that it may run,
+		// and only then sleeps on workerCondition. Whoever makes new work available wakes a single sleeper by
+		// bumping workEpoch, and only if nobody who could run the work is spinning, as a spinner will pick it
+		// up sooner. Work tied to a NUMA node wakes all of the sleepers instead, since the one that would be
+		// woken might not be on the node. workerMutex is only taken when someone is actually asleep, so it
+		// stays off the path of running loops. Back-to-back short loops thus find the workers still spinning,
+		// and a loop that is split many times wakes workers one by one as its ranges are pushed rather than all
+		// at once.
+		std::mutex workerMutex;
+		std::condition_variable workerCondition;
+		std::atomic<uint64_t> workEpoch{ 0 };
+		std::atomic<int> idleWorkers{ 0 };
+		// In all, and by the node of the spinning workers.
+		std::atomic<int> spinningWorkers{ 0 };
+		std::unique_ptr<std::atomic<int>[]> spinningWorkersOnNode;
+
+		// Bookkeeping variables to help with the implementation of MergeWorkerThreadStats().
+		// Incremented each time the main thread would like the workers to report their stats.
+		std::atomic<uint64_t> reportStatsEpoch{ 0 };
+		// For each worker, by thread index: whether it's in the middle of a work item, and the last epoch it
+		// reported its stats for. Busy workers aren't waited for, as the item could take arbitrarily long;
+		// they report once they've finished it.
+		struct WorkerReport
+		{
+			std::atomic<bool> busy{ false };
+			std::atomic<uint64_t> epoch{ 0 };
+		};
+		std::unique_ptr<WorkerReport[]> workerReports;
+		// After pushing the workers to report their stats, the main thread waits on this condition variable
+		// until all of those that aren't busy have done so.
+		std::condition_variable reportDoneCondition;
+		std::mutex reportDoneMutex;
+	};
+
+	// Every pool that's alive, so that MergeWorkerThreadStats() can get to all of their workers.
+	static std::mutex poolsMutex;
+	static std::vector<ThreadPool*> pools;
+
+	ThreadPool::ThreadPool(int nWorkers, ThreadPriority priority, bool pinThreads)
+		: priority{ priority }
+	{
+		int nThreads = nWorkers + 1;
+		workQueues.reset(new WorkQueue[nThreads]);
+		nWorkQueues = nThreads;
+		workerReports.reset(new WorkerReport[nThreads]);
+
+		std::vector<int> processors(nThreads, -1);
+		threadNumaNode.assign(nThreads, 0);
+		if (pinThreads) processors = assignThreadProcessors(nThreads);
+		for (int t = 0; t < nThreads; ++t) workQueues[t].SetNumaNodeCount(nNumaNodes);
+		spinningWorkersOnNode.reset(new std::atomic<int>[nNumaNodes]());
+		stealOrder.assign(nThreads, std::vector<int>());
+		for (int t = 0; t < nThreads; ++t)
+		{
+			for (int i = 1; i < nThreads; ++i)
+				if (threadNumaNode[(t + i) % nThreads] == threadNumaNode[t]) stealOrder[t].push_back((t + i) % nThreads);
+			for (int i = 1; i < nThreads; ++i)
+				if (threadNumaNode[(t + i) % nThreads] != threadNumaNode[t]) stealOrder[t].push_back((t + i) % nThreads);
+		}
+		// The thread that creates the pool is taken to be the one that will mostly be starting work on it and
+		// helping out with it, so it's pinned along with the workers.
+		if (processors[0] >= 0) pinCurrentThread(processors[0]);
+
+		// The barrier ensures all worker threads get past their call to ProfilerWorkerThreadInit() before returning
+		// from this function. In turn, this ensures that the profiling system isn't started until after all worker
+		// threads thave done that.
+		std::shared_ptr<Barrier> barrier = std::make_shared<Barrier>(nThreads);
+		for (int i = 0; i < nWorkers; ++i)
+			threads.push_back(std::thread(&ThreadPool::workerThreadFunc, this, i + 1, processors[i + 1], barrier));
+		barrier->Wait();
+
+		std::lock_guard<std::mutex> lock{ poolsMutex };
+		pools.push_back(this);
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ poolsMutex };
+			pools.erase(std::find(pools.begin(), pools.end(), this));
+		}
+		{
+			std::lock_guard<std::mutex> lock{ workerMutex };
+			shutdownThreads = true;
+			workerCondition.notify_all();
+		}
+		for (std::thread& thread : threads) thread.join();
+	}
+
+	// Called after pushing a work item that any thread may run (node -1) or that's tied to the given node.
+	// The sequentially consistent loads pair up with the ones in workerThreadFunc(): either this sees the
+	// worker spinning or asleep, or the worker sees the item.
+	void ThreadPool::wakeWorker(int node)
+	{
+		if (idleWorkers.load() == 0) return;
+		if ((node < 0 ? spinningWorkers : spinningWorkersOnNode[node]).load() > 0) return;
+		std::lock_guard<std::mutex> lock{ workerMutex };
+		++workEpoch;
+		if (node < 0)
+			workerCondition.notify_one();
 		else
-			cv.wait(lock, [this] {return count == 0; });
+			workerCondition.notify_all();
 	}
 
-	int MaxThreadIndex()
+	// Wakes workers for whatever is queued, as when a spinning worker has taken one item and there may be
+	// more that nobody was woken for.
+	void ThreadPool::wakeWorkersForQueuedWork()
 	{
-		return RayTracerOptions.nThreads == 0 ? NumSystemCores() : RayTracerOptions.nThreads;
+		for (int node = -1; node < nNumaNodes; ++node)
+			if (anyWorkQueued(node)) wakeWorker(node);
 	}
 
-	int NumSystemCores()
+	bool ThreadPool::anyWorkQueued(int node) const
 	{
-		return std::max(1u, std::thread::hardware_concurrency());
+		for (int i = 0; i < nWorkQueues; ++i)
+			if (workQueues[i].HasWorkQueued(node)) return true;
+		return false;
+	}
+
+	// Try to steal a range from another thread's queue. Victims on the same NUMA node are tried first, each
+	// thread starting after its own queue so that the thieves don't all pile onto the same one.
+	bool ThreadPool::stealWork(WorkItem* item, int minDepth)
+	{
+		int index = localIndex();
+		for (int victim : stealOrder[index])
+			if (workQueues[victim].Steal(item, threadNumaNode[index], minDepth))
+			{
+				++nRangesStolen;
+				return true;
+			}
+		return false;
+	}
+
+	bool ThreadPool::findWork(WorkItem* item, int minDepth)
+	{
+		return localWorkQueue().Pop(item, threadNumaNode[localIndex()], minDepth) || stealWork(item, minDepth);
+	}
+
+	static void runTask(const std::shared_ptr<Task>& task)
+	{
+		uint64_t oldState = ProfilerState;
+		ProfilerState = task->profilerState;
+		uint64_t tracedPhases = ProfileTracing.load(std::memory_order_relaxed) ? task->profilerState & ~oldState : 0;
+		if (tracedPhases) TraceProfilePhases(tracedPhases, true);
+		int oldDepth = workDepth;
+		workDepth = task->depth;
+		ThreadPool* oldPool = currentPool;
+		currentPool = task->pool;
+		task->func();
+		// Release whatever the function captured now rather than when the last Future goes away.
+		task->func = nullptr;
+		if (tracedPhases) TraceProfilePhases(tracedPhases, false);
+		ProfilerState = oldState;
+		workDepth = oldDepth;
+		currentPool = oldPool;
+
+		std::vector<std::shared_ptr<Task>> dependents;
+		{
+			std::lock_guard<std::mutex> lock{ task->mutex };
+			task->finished = true;
+			dependents.swap(task->dependents);
+		}
+		for (std::shared_ptr<Task>& dependent : dependents)
+		{
+			if (--dependent->pendingDependencies != 0) continue;
+			if (dependent->pool && !dependent->pool->Serial())
+				dependent->pool->ScheduleTask(std::move(dependent));
+			else
+				runTask(dependent);
+		}
+	}
+
+	// Queue a task whose dependencies have finished on the current thread, where it's likely to find the
+	// results of the task that just finished in cache.
+	void ThreadPool::ScheduleTask(std::shared_ptr<Task> task)
+	{
+		localWorkQueue().Push(WorkItem{ nullptr, 0, 0, std::move(task) });
+		wakeWorker(-1);
+	}
+
+	// Run the iterations of 'item' a chunk at a time. Whenever the local queue has run dry, the upper half of
+	// the remaining range is pushed back onto it first, so that it can be stolen by an idle thread. Ranges are
+	// thus only split as finely as the load actually requires. While the work offered that way hasn't been
+	// taken, nobody is short of work, so each chunk is twice as long as the one before; tight loop bodies then
+	// see a handful of calls per range rather than one per chunkSize iterations.
+	void ThreadPool::runWorkItem(WorkItem item)
+	{
+		if (item.task)
+		{
+			runTask(item.task);
+			return;
+		}
+
+		ParallelForLoop& loop = *item.loop;
+		WorkQueue& queue = localWorkQueue();
+		int64_t runSize = loop.ChunkSize(nWorkQueues);
+		while (item.begin < item.end)
+		{
+			if (loop.Cancelled())
+			{
+				loop.Skip(item.begin, item.end);
+				return;
+			}
+			if (queue.Empty())
+			{
+				runSize = loop.ChunkSize(nWorkQueues);
+				if (item.end - item.begin > runSize)
+				{
+					int64_t mid = item.begin + (item.end - item.begin) / 2;
+					// Deterministic loops are only split between chunks, rounding up so neither half is empty.
+					if (loop.deterministic)
+						mid = loop.begin + (mid - loop.begin + loop.chunkSize - 1) / loop.chunkSize * loop.chunkSize;
+					queue.Push(WorkItem{ &loop, mid, item.end, nullptr });
+					wakeWorker(loop.numaNode);
+					item.end = mid;
+				}
+			}
+			int64_t indexStart = item.begin;
+			int64_t indexEnd = std::min(item.begin + runSize, item.end);
+			item.begin = indexEnd;
+			// Cancellable loops stick to the chunk size so that they notice being cancelled promptly, and
+			// deterministic ones so that each call covers exactly one chunk.
+			runSize = loop.cancel || loop.deterministic ? loop.ChunkSize(nWorkQueues)
+				: std::min(2 * runSize, item.end - item.begin);
+			loop.Run(indexStart, indexEnd);
+		}
+	}
+
+	// Hand the whole loop to the current thread's queue, then help out with loop iterations (of this or any
+	// other loop) until all of its iterations have finished.
+	void ThreadPool::RunLoop(ParallelForLoop& loop)
+	{
+		// A loop tied to a node starts out in the queue of the first thread on that node.
+		WorkQueue* queue = &localWorkQueue();
+		if (loop.numaNode >= 0 && loop.numaNode != threadNumaNode[localIndex()])
+			queue = &workQueues[std::find(threadNumaNode.begin(), threadNumaNode.end(), loop.numaNode) -
+								threadNumaNode.begin()];
+		queue->Push(WorkItem{ &loop, loop.begin, loop.end, nullptr });
+		wakeWorker(loop.numaNode);
+
+		// Only the time of the outermost loop counts; the time a nested loop takes is part of the enclosing
+		// loop's busy time.
+		bool outermost = workDepth == 0;
+		WorkItem item;
+		while (!loop.Finished())
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			if (findWork(&item, loop.depth))
+			{
+				runWorkItem(item);
+				if (outermost) busyNanoseconds += nanosecondsSince(start);
+			}
+			else
+			{
+				// The last iterations are running on other threads.
+				std::this_thread::yield();
+				if (outermost) idleNanoseconds += nanosecondsSince(start);
+			}
+		}
+	}
+
+	void ThreadPool::WaitForTask(const std::shared_ptr<Task>& task)
+	{
+		// Unlike a loop, the task may have been spawned from further out than the thread's current work, so
+		// it and its dependencies could be at any depth; any work is fair game while waiting for it.
+		WorkItem item;
+		while (!TaskFinished(task))
+		{
+			if (findWork(&item))
+				runWorkItem(item);
+			else
+				std::this_thread::yield();
+		}
 	}
 
-	static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier)
+	void ThreadPool::workerThreadFunc(int tIndex, int processor, std::shared_ptr<Barrier> barrier)
 	{
 		// TODO: log this msg: "Started execution in worker thread " << tIndex;
 		ThreadIndex = tIndex;
+		ownPool = this;
+		currentPool = this;
+		// Pin before anything is allocated so that first-touch allocations land on this thread's node.
+		if (processor >= 0) pinCurrentThread(processor);
+		if (priority != ThreadPriority::Normal) setCurrentThreadPriority(priority);
 
 		// Give the profiler a chance to do per-thread initialization for the worker thread before the profiling
 		// system actually stops running.
 		ProfilerWorkerThreadInit();
 
+		// Read before the barrier, as stats may be asked for as soon as the pool has been made.
+		uint64_t statsEpoch = reportStatsEpoch;
+
 		// The main thread sets up a barrier to make sure all workers have called ProfilerWorkerThreadInit() before
 		// it continues (and actually starts the profiling system). Then release the reference to the Barrier so
 		// that it's freed once all of the threads have gone past it.
 		barrier->Wait();
 		barrier.reset();
 
-		std::unique_lock<std::mutex> lock{ workListMutex };
+		// Work tied to another node is left to the threads on that node; this thread neither spins on it nor
+		// stays awake for it.
+		const int node = threadNumaNode[tIndex];
+		WorkerReport& report = workerReports[tIndex];
+		auto run = [&](const WorkItem& item, std::chrono::steady_clock::time_point start)
+		{
+			// A stats report that was asked for just before this thread became busy may be waiting on it.
+			report.busy = true;
+			if (statsEpoch != reportStatsEpoch)
+			{
+				std::lock_guard<std::mutex> lock{ reportDoneMutex };
+				reportDoneCondition.notify_all();
+			}
+			runWorkItem(item);
+			report.busy = false;
+			busyNanoseconds += nanosecondsSince(start);
+		};
+		WorkItem item;
 		while (!shutdownThreads)
 		{
-			// If stats-reporting is on, and all worker threads have merged their statts, wake up the main thread and
-			// then sleep again. Otherwise, sleep until there are more tasks to run. Finally, if the first two conditions
-			// don't hold, get work from workList and run loop iterations.
-			if (reportWorkerStats)
+			// If stats-reporting has been requested since the last time around, merge this thread's stats and
+			// let the main thread know. Otherwise, run whatever work can be found in the local queue or stolen
+			// from another one. Finally, if there's nothing to do, sleep until more work shows up.
+			if (statsEpoch != reportStatsEpoch)
 			{
+				statsEpoch = reportStatsEpoch;
 				ReportThreadStats();
-				if (--reporterCount == 0)
-					reportDoneCondition.notify_one();
-				workListCondition.wait(lock);
+				std::lock_guard<std::mutex> lock{ reportDoneMutex };
+				report.epoch = statsEpoch;
+				reportDoneCondition.notify_all();
 			}
-			else if (!workList)
-				workListCondition.wait(lock);
+			else if (findWork(&item))
+				run(item, std::chrono::steady_clock::now());
 			else
 			{
-				ParallelForLoop& loop = *workList;
-
-				// Run a chunk of loop iteration for 'loop'
-
-				// Find the set of loop iterations to run next
-				int64_t indexStart = loop.nextIndex;
-				int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-				loop.activeWorkers++;
-
-				// Run loop indices in [indexStart, indexEnd)
-				lock.unlock();
-				for (int64_t index = indexStart; index < indexEnd; ++index)
+				std::chrono::steady_clock::time_point idleStart = std::chrono::steady_clock::now();
+				++spinningWorkers;
+				++spinningWorkersOnNode[node];
+				bool found = false;
+				for (int spin = 0; spin < maxIdleSpins && !shutdownThreads && statsEpoch == reportStatsEpoch; ++spin)
 				{
-					uint64_t oldState = ProfilerState;
-					ProfilerState = loop.profilerState;
-					if (loop.func1D)
-						loop.func1D(index);
-					else
+					if (anyWorkFor(node) && findWork(&item))
 					{
-						assert(loop.func2D);
-						loop.func2D(Point2i(index % loop.nX, index / loop.nX));
+						found = true;
+						break;
 					}
-					ProfilerState = oldState;
+					cpuPause();
 				}
-				lock.lock();
-				// Update loop to reflect completion of iterations
-				loop.activeWorkers--;
-				if (loop.Finished()) workListCondition.notify_all();
+				--spinningWorkersOnNode[node];
+				--spinningWorkers;
+				if (found)
+				{
+					++nSpinWakeups;
+					// Work pushed while this thread was spinning didn't wake anybody else, so pass it on.
+					wakeWorkersForQueuedWork();
+					std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+					idleNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(start - idleStart).count();
+					run(item, start);
+					continue;
+				}
+
+				std::unique_lock<std::mutex> lock{ workerMutex };
+				++idleWorkers;
+				uint64_t epoch = workEpoch;
+				// Work pushed before idleWorkers was incremented may not have been announced; look again.
+				if (!anyWorkFor(node))
+				{
+					++nWorkerSleeps;
+					workerCondition.wait(lock, [&]()
+						{
+							return workEpoch != epoch || shutdownThreads || statsEpoch != reportStatsEpoch;
+						});
+				}
+				--idleWorkers;
+				idleNanoseconds += nanosecondsSince(idleStart);
 			}
 		}
+		// Whatever was counted since the last report would otherwise be lost with the thread.
+		ReportThreadStats();
 		// TODO: Log this msg: "Exiting worker thread " << tIndex;
 	}
 
-	void ParallelFor(std::function<void(int64_t)> func, int64_t count, int chunkSize)
+	// Works out which processor each thread is to be pinned to, following RayTracerOptions.threadAffinity, and
+	// sets up the NUMA node bookkeeping to match. Returns -1 for threads that aren't to be pinned.
+	std::vector<int> ThreadPool::assignThreadProcessors(int nThreads)
 	{
-		assert(threads.size() > 0 || MaxThreadIndex() == 1);
-		
-		// Run iterations immediately if not using threads or if count is small
-		if (threads.empty() || count < chunkSize)
+		std::vector<int> processors(nThreads, -1);
+		threadNumaNode.assign(nThreads, 0);
+		nNumaNodes = 1;
+		if (RayTracerOptions.threadAffinity == ThreadAffinity::None) return processors;
+
+		std::vector<std::vector<int>> nodes = numaNodeProcessors();
+		std::vector<int> all;
+		for (const std::vector<int>& node : nodes) all.insert(all.end(), node.begin(), node.end());
+		for (int i = 0; i < nThreads; ++i)
 		{
-			for (int64_t i = 0; i < count; ++i) func(i);
-			return;
+			switch (RayTracerOptions.threadAffinity)
+			{
+			case ThreadAffinity::Compact:
+				processors[i] = all[i % all.size()];
+				break;
+			case ThreadAffinity::Scatter:
+			{
+				const std::vector<int>& node = nodes[i % nodes.size()];
+				processors[i] = node[(i / nodes.size()) % node.size()];
+				break;
+			}
+			case ThreadAffinity::List:
+				if (!RayTracerOptions.threadProcessors.empty())
+					processors[i] = RayTracerOptions.threadProcessors[i % RayTracerOptions.threadProcessors.size()];
+				break;
+			default:
+				break;
+			}
+			for (size_t n = 0; n < nodes.size(); ++n)
+				if (std::find(nodes[n].begin(), nodes[n].end(), processors[i]) != nodes[n].end())
+					threadNumaNode[i] = (int)n;
 		}
+		nNumaNodes = (int)nodes.size();
+		return processors;
+	}
+
+	void ThreadPool::MergeWorkerThreadStats()
+	{
+		std::unique_lock<std::mutex> doneLock{ reportDoneMutex };
+		if (threads.empty()) return;
 
-		// Create and enqueue ParallelForLoop for this loop
-		ParallelForLoop loop(std::move(func), count, chunkSize, CurrentProfilerState());
-		workListMutex.lock();
-		loop.next = workList;
-		workList = &loop;
-		workListMutex.unlock();
+		// Set up state so that the worker threads will know that we would like them to report their
+		// thread-specific stats when they wake up.
+		uint64_t epoch;
+		{
+			std::lock_guard<std::mutex> lock{ workerMutex };
+			epoch = ++reportStatsEpoch;
+			// Wake up the worker threads.
+			workerCondition.notify_all();
+		}
 
-		// Notify worker threads of work to be done
-		std::unique_lock<std::mutex> lock{ workListMutex };
-		workListCondition.notify_all();
+		// Wait for all of them to merge their stats, except for those that are busy and will do so later.
+		reportDoneCondition.wait(doneLock, [&]()
+			{
+				for (size_t t = 1; t <= threads.size(); ++t)
+					if (workerReports[t].epoch < epoch && !workerReports[t].busy) return false;
+				return true;
+			});
+	}
 
-		// Help out with parallel loop iterations in the current thread
-		while (!loop.Finished())
+	void Barrier::Wait()
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		assert(count > 0);
+		// If it's the last thread to reach the barrier; wake up all the other threads before exiting otherwise
+		// give up the lock and wait to be notified as there are still threads that haven't reached.
+		if (--count == 0)
+			cv.notify_all();
+		else
+			cv.wait(lock, [this] {return count == 0; });
+	}
+
+	bool SpinBarrier::Wait()
+	{
+		bool arrivalSense = sense.load();
+		if (--remaining == 0)
+		{
+			// Everyone's here: reset for the next pass before letting the others go, as they may arrive at it
+			// right away.
+			remaining = count;
+			sense = !arrivalSense;
+			if (sleepers.load() > 0)
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				cv.notify_all();
+			}
+			return true;
+		}
+
+		for (int spin = 0; spin < maxIdleSpins; ++spin)
 		{
-			// Run a chunk of loop iterations for 'loop'
+			if (sense.load() != arrivalSense) return false;
+			cpuPause();
+		}
+		// The sequentially consistent increment and loads pair up with those of the last thread to arrive:
+		// either it sees this one asleep, or this one sees the flipped sense.
+		std::unique_lock<std::mutex> lock{ mutex };
+		++sleepers;
+		cv.wait(lock, [&]() { return sense.load() != arrivalSense; });
+		--sleepers;
+		return false;
+	}
+
+	// GlobalThreadIndex() numbers that threads have given back, to be handed out again before new ones.
+	static std::mutex globalThreadIndexMutex;
+	static std::vector<int> freeGlobalThreadIndices;
+	static int nGlobalThreadIndices = 0;
+
+	// Gives the thread's number back when the thread exits.
+	struct GlobalThreadIndexReleaser
+	{
+		~GlobalThreadIndexReleaser()
+		{
+			if (globalThreadIndex < 0) return;
+			std::lock_guard<std::mutex> lock{ globalThreadIndexMutex };
+			freeGlobalThreadIndices.push_back(globalThreadIndex);
+			globalThreadIndex = -1;
+		}
+		bool registered = false;
+	};
+
+	static thread_local GlobalThreadIndexReleaser globalThreadIndexReleaser;
+
+	int AssignGlobalThreadIndex()
+	{
+		// Touching the releaser constructs it, which has it destroyed when the thread exits.
+		globalThreadIndexReleaser.registered = true;
+		std::lock_guard<std::mutex> lock{ globalThreadIndexMutex };
+		if (freeGlobalThreadIndices.empty())
+			globalThreadIndex = nGlobalThreadIndices++;
+		else
+		{
+			// The smallest, so that the numbers in use stay packed at the bottom.
+			auto smallest = std::min_element(freeGlobalThreadIndices.begin(), freeGlobalThreadIndices.end());
+			globalThreadIndex = *smallest;
+			freeGlobalThreadIndices.erase(smallest);
+		}
+		return globalThreadIndex;
+	}
+
+	int MaxThreadIndex()
+	{
+		return RayTracerOptions.nThreads == 0 ? NumSystemCores() : RayTracerOptions.nThreads;
+	}
+
+	int NumSystemCores()
+	{
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	std::shared_ptr<ThreadPool> MakeThreadPool(int nThreads, ThreadPriority priority)
+	{
+		assert(nThreads >= 0);
+		return std::make_shared<ThreadPool>(nThreads, priority, false);
+	}
 
-			// Find the set of loop iterations to run next
-			int64_t indexStart = loop.nextIndex;
-			int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+	ThreadPool* CurrentThreadPool()
+	{
+		return currentPool ? currentPool : defaultPool.get();
+	}
+
+	ThreadPool* SetCurrentThreadPool(ThreadPool* pool)
+	{
+		ThreadPool* previous = currentPool;
+		currentPool = pool;
+		return previous;
+	}
+
+	// Writes a line per chunk: the loop's number, the index of the thread that ran the chunk in its pool,
+	// the chunk's range of iterations, and when it started and finished in microseconds since the loop began.
+	static void writeLoopTrace(const ParallelForLoop& loop)
+	{
+		std::lock_guard<std::mutex> lock{ loopTraceMutex };
+		if (!loopTraceFile) return;
+		int64_t loopNumber = nTracedLoops++;
+		for (const ChunkTrace& chunk : loop.trace)
+			fprintf(loopTraceFile, "%lld,%d,%lld,%lld,%.3f,%.3f\n", (long long)loopNumber, chunk.threadIndex,
+				(long long)chunk.begin, (long long)chunk.end, chunk.startNanoseconds / 1e3, chunk.endNanoseconds / 1e3);
+	}
 
-			// Update 'loop' to reflect iterations this thread will run
-			loop.nextIndex = indexEnd;
-			if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-			loop.activeWorkers++;
+	static int64_t parallelForChunks(const std::function<void(int64_t, int64_t)>& func, int64_t begin, int64_t end,
+		int chunkSize, int numaNode, const CancellationToken* cancel)
+	{
+		ThreadPool* pool = CurrentThreadPool();
+		assert(pool || MaxThreadIndex() == 1);
+		assert(chunkSize > 0 || chunkSize == AutoChunkSize);
+		// Deterministic loops can't size their chunks by measuring them.
+		bool deterministic = RayTracerOptions.deterministic;
+		if (deterministic && chunkSize == AutoChunkSize)
+			chunkSize = (int)std::min((int64_t)std::numeric_limits<int>::max(),
+				std::max((int64_t)1, (end - begin + deterministicAutoChunks - 1) / deterministicAutoChunks));
 
-			// Run loop indices in [indexStart, indexEnd)
-			lock.unlock();
-			for (int64_t index = indexStart; index < indexEnd; ++index)
+		// Run iterations immediately if not using threads or if count is small, a chunk at a time if the loop
+		// can be cancelled or must be chunked the same way as with threads.
+		if (!pool || pool->Serial() || end - begin <= std::max(chunkSize, 1))
+		{
+			if (!cancel && !deterministic)
 			{
-				uint64_t oldState = ProfilerState;
-				ProfilerState = loop.profilerState;
-				if (loop.func1D)
-					loop.func1D(index);
-				else
-				{
-					assert(loop.func2D);
-					loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-				}
-				ProfilerState = oldState;
+				if (begin < end) func(begin, end);
+				return std::max(end - begin, (int64_t)0);
 			}
-			lock.lock();
-			// Update 'loop' to reflect completion of iterations
-			loop.activeWorkers--;
+			int64_t i = begin;
+			for (; i < end && !(cancel && cancel->IsCancelled()); i = std::min(i + std::max(chunkSize, 1), end))
+				func(i, std::min(i + std::max(chunkSize, 1), end));
+			return std::max(i - begin, (int64_t)0);
+		}
+
+		// Without any thread on the requested node (threads may not be pinned at all), any thread will do.
+		if (!pool->HasNumaNode(numaNode)) numaNode = -1;
+		ParallelForLoop loop(pool, func, begin, end, chunkSize, numaNode, cancel, CurrentProfilerState(),
+			deterministic);
+		pool->RunLoop(loop);
+		ReportValue(iterationsPerLoop, end - begin);
+		if (loop.AutoChunked())
+		{
+			++nAutoChunkLoops;
+			ReportValue(chunksPerAutoLoop, loop.nChunks);
 		}
+		if (loop.traced) writeLoopTrace(loop);
+		return end - begin - loop.skipped.load(std::memory_order_relaxed);
+	}
+
+	void ParallelForChunks(const std::function<void(int64_t, int64_t)>& func, int64_t begin, int64_t end,
+		int chunkSize, int numaNode)
+	{
+		parallelForChunks(func, begin, end, chunkSize, numaNode, nullptr);
 	}
 
-	void PrallelFor2D(std::function<void(Point2i)> func, const Point2i& count)
+	int64_t ParallelForChunks(const std::function<void(int64_t, int64_t)>& func, int64_t begin, int64_t end,
+		const CancellationToken& cancel, int chunkSize, int numaNode)
 	{
-		assert(threads.size() > 0 || MaxThreadIndex() == 1);
+		return parallelForChunks(func, begin, end, chunkSize, numaNode, &cancel);
+	}
 
-		if(threads.empty() || count.x * count.y <= 1)
+	std::shared_ptr<Task> SpawnTask(std::function<void()> func, const std::vector<std::shared_ptr<Task>>& dependencies)
+	{
+		ThreadPool* pool = CurrentThreadPool();
+		std::shared_ptr<Task> task = std::make_shared<Task>(pool, std::move(func), CurrentProfilerState());
+		for (const std::shared_ptr<Task>& dependency : dependencies)
 		{
-			for (int y = 0; y < count.y; ++y)
-				for (int x = 0; x < count.x; ++x) func(Point2i(x, y));
-			return;
+			std::lock_guard<std::mutex> lock{ dependency->mutex };
+			if (!dependency->finished)
+			{
+				++task->pendingDependencies;
+				dependency->dependents.push_back(task);
+			}
+		}
+		// Without worker threads, the task is run right away.
+		if (--task->pendingDependencies == 0)
+		{
+			if (pool && !pool->Serial())
+				pool->ScheduleTask(task);
+			else
+				runTask(task);
 		}
+		return task;
+	}
+
+	bool TaskFinished(const std::shared_ptr<Task>& task)
+	{
+		return task->finished.load(std::memory_order_acquire);
+	}
 
-		ParallelForLoop loop(std::move(func), count, CurrentProfilerState());
+	void WaitForTask(const std::shared_ptr<Task>& task)
+	{
+		if (task->pool && !task->pool->Serial())
+			task->pool->WaitForTask(task);
+		else
+		{
+			// The task runs as soon as its dependencies have finished, but those may be running on another pool.
+			while (!TaskFinished(task)) std::this_thread::yield();
+		}
+	}
 
+	std::vector<Point2i> TileOrderPoints(const Point2i& count, TileOrder order)
+	{
+		std::vector<Point2i> points;
+		if (count.x <= 0 || count.y <= 0) return points;
+		points.reserve(count.x * count.y);
+		if (order == TileOrder::RowMajor)
 		{
-			std::lock_guard<std::mutex> lock{ workListMutex };
-			loop.next = workList;
-			workList = &loop;
+			for (int y = 0; y < count.y; ++y)
+				for (int x = 0; x < count.x; ++x) points.push_back(Point2i(x, y));
+			return points;
 		}
 
-		std::unique_lock<std::mutex> lock{ workListMutex };
-		workListCondition.notify_all();
+		Bounds2i bounds;
+		bounds.pMin = Point2i(0, 0);
+		bounds.pMax = count;
+		SpaceFillingCurve curve = (order == TileOrder::Morton) ? SpaceFillingCurve::Morton : SpaceFillingCurve::Hilbert;
+		for (Point2i p : Bounds2iCurve(bounds, curve)) points.push_back(p);
+		return points;
+	}
 
-		// Help out with parallel loop iterations in the current thread
-		while (!loop.Finished())
+	double TileCosts::TotalSeconds() const
+	{
+		int64_t total = 0;
+		for (int i = 0; i < count.x * count.y; ++i) total += nanoseconds[i].load(std::memory_order_relaxed);
+		return total / 1e9;
+	}
+
+	void TileCosts::Reset(const Point2i& count)
+	{
+		this->count = count;
+		nanoseconds.reset(new std::atomic<int64_t>[std::max(count.x * count.y, 0)]());
+	}
+
+	bool TileCosts::Write(const std::string& filename) const
+	{
+		FILE* f = fopen(filename.c_str(), "w");
+		if (!f) return false;
+		for (int y = 0; y < count.y; ++y)
+			for (int x = 0; x < count.x; ++x)
+				fprintf(f, "%.3f%c", Seconds(Point2i(x, y)) * 1e3, x + 1 < count.x ? ',' : '\n');
+		return fclose(f) == 0;
+	}
+
+	// A tile, or part of one, and what it's expected to cost.
+	struct TilePiece
+	{
+		Bounds2i bounds;
+		Point2i tile;
+		double cost;
+	};
+
+	// Halves 'bounds' along its longer side until each piece is expected to cost no more than maxCost, assuming
+	// the cost is spread evenly over its pixels.
+	static void splitTile(const Bounds2i& bounds, const Point2i& tile, double cost, double maxCost,
+		std::vector<TilePiece>* pieces)
+	{
+		Vector2i extent = bounds.Diagonal();
+		if (cost <= maxCost || (extent.x <= 1 && extent.y <= 1))
 		{
-			// Run a chunk of loop iterations for 'loop'
+			pieces->push_back(TilePiece{ bounds, tile, cost });
+			return;
+		}
+		Bounds2i first = bounds, second = bounds;
+		if (extent.x >= extent.y)
+			first.pMax.x = second.pMin.x = bounds.pMin.x + extent.x / 2;
+		else
+			first.pMax.y = second.pMin.y = bounds.pMin.y + extent.y / 2;
+		double firstCost = cost * first.Area() / (double)bounds.Area();
+		splitTile(first, tile, firstCost, maxCost, pieces);
+		splitTile(second, tile, cost - firstCost, maxCost, pieces);
+	}
 
-			// Find the set of loop iterations to run next
-			int64_t indexStart = loop.nextIndex;
-			int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
+	void ParallelForTiles(const std::function<void(const Bounds2i&)>& func, const Bounds2i& pixelBounds,
+		int tileSize, TileCosts* costs)
+	{
+		assert(tileSize > 0);
+		Vector2i extent = pixelBounds.Diagonal();
+		if (extent.x <= 0 || extent.y <= 0) return;
+		Point2i count((extent.x + tileSize - 1) / tileSize, (extent.y + tileSize - 1) / tileSize);
+		auto tileBounds = [&](const Point2i& tile)
+		{
+			Bounds2i bounds;
+			bounds.pMin = pixelBounds.pMin + Vector2i(tile.x * tileSize, tile.y * tileSize);
+			bounds.pMax = Point2i(std::min(bounds.pMin.x + tileSize, pixelBounds.pMax.x),
+				std::min(bounds.pMin.y + tileSize, pixelBounds.pMax.y));
+			return bounds;
+		};
+		auto runPiece = [&](const Bounds2i& bounds, const Point2i& tile)
+		{
+			if (!costs)
+			{
+				func(bounds);
+				return;
+			}
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			func(bounds);
+			costs->Add(tile, nanosecondsSince(start));
+		};
 
-			// Update 'loop' to reflect iterations this thread will run
-			loop.nextIndex = indexEnd;
-			if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-			loop.activeWorkers++;
+		// Without measurements to go on, run the tiles in Hilbert curve order.
+		if (!costs || !costs->Measured() || costs->Count() != count)
+		{
+			if (costs) costs->Reset(count);
+			std::vector<Point2i> tiles = TileOrderPoints(count, TileOrder::Hilbert);
+			ParallelForChunks([&](int64_t chunkBegin, int64_t chunkEnd)
+				{
+					for (int64_t i = chunkBegin; i < chunkEnd; ++i) runPiece(tileBounds(tiles[i]), tiles[i]);
+				}, 0, tiles.size());
+			return;
+		}
 
-			// Run loop indices in [indexStart, indexEnd)
-			lock.unlock();
-			for (int64_t index = indexStart; index < indexEnd; ++index)
+		// A pass can't finish before its most expensive piece has, so no piece should cost more than a
+		// fraction of what each thread has to do overall. Splitting is left out in deterministic mode, where
+		// func must be given the same pieces every time.
+		ThreadPool* pool = CurrentThreadPool();
+		int nThreads = pool ? pool->NumThreads() : 1;
+		double maxCost = costs->TotalSeconds() / (2 * nThreads);
+		std::vector<TilePiece> pieces;
+		for (int y = 0; y < count.y; ++y)
+			for (int x = 0; x < count.x; ++x)
 			{
-				uint64_t oldState = ProfilerState;
-				ProfilerState = loop.profilerState;
-				if (loop.func1D)
-					loop.func1D(index);
+				Point2i tile(x, y);
+				double cost = costs->Seconds(tile);
+				if (RayTracerOptions.deterministic || cost <= maxCost || maxCost == 0)
+					pieces.push_back(TilePiece{ tileBounds(tile), tile, cost });
 				else
 				{
-					assert(loop.func2D);
-					loop.func2D(Point2i(index % loop.nX, index / loop.nX));
+					splitTile(tileBounds(tile), tile, cost, maxCost, &pieces);
+					++nTilesSplit;
 				}
-				ProfilerState = oldState;
 			}
-			lock.lock();
-			// Update 'loop' to reflect completion of iterations
-			loop.activeWorkers--;
-		}
+		costs->Reset(count);
+
+		// Longest processing time first: every thread takes the most expensive piece that's left whenever it
+		// needs another, which is why pieces are handed out one at a time through a shared counter rather than
+		// by splitting ranges.
+		std::stable_sort(pieces.begin(), pieces.end(),
+			[](const TilePiece& a, const TilePiece& b) { return a.cost > b.cost; });
+		std::atomic<int64_t> nextPiece{ 0 };
+		ParallelFor([&](int64_t)
+			{
+				for (int64_t i = nextPiece++; i < (int64_t)pieces.size(); i = nextPiece++)
+					runPiece(pieces[i].bounds, pieces[i].tile);
+			}, nThreads);
+	}
+
+	int NumaNodeCount() { return defaultPool ? defaultPool->NumaNodeCount() : 1; }
+
+	int ThreadNumaNode(int threadIndex)
+	{
+		return defaultPool ? defaultPool->ThreadNumaNode(threadIndex) : 0;
 	}
 
 	void ParallelInit()
 	{
-		assert(threads.size() == 0);
-		int nThreads = MaxThreadIndex();
+		assert(!defaultPool);
 		ThreadIndex = 0;
-
-		// The barrier ensures all worker threads get past their call to ProfilerWorkerThreadInit() before returning
-		// from this function. In turn, this ensures that the profiling system isn't started until after all worker
-		// threads thave done that.
-		std::shared_ptr<Barrier> barrier = std::make_shared<Barrier>(nThreads);
-
 		// Launch one fewer worker thread than the total number since the main thread helps out too.
-		for (int i = 0; i < nThreads - 1; ++i)
-			threads.push_back(std::thread(workerThreadFunc, i + 1, barrier));
+		defaultPool = std::make_shared<ThreadPool>(MaxThreadIndex() - 1, ThreadPriority::Normal, true);
 
-		barrier->Wait();
+		if (!RayTracerOptions.loopTraceFile.empty())
+		{
+			std::lock_guard<std::mutex> lock{ loopTraceMutex };
+			loopTraceFile = fopen(RayTracerOptions.loopTraceFile.c_str(), "w");
+			if (loopTraceFile) fprintf(loopTraceFile, "loop,thread,begin,end,start_us,end_us\n");
+			nTracedLoops = 0;
+		}
 	}
 
 	void ParallelCleanup()
 	{
-		if (threads.empty()) return;
+		defaultPool.reset();
 
-		{
-			std::lock_guard<std::mutex> lock{ workListMutex };
-			shutdownThreads = true;
-			workListCondition.notify_all();
-		}
-
-		for (std::thread& thread : threads) thread.join();
-		threads.erase(threads.begin(), threads.end());
-		shutdownThreads = false;
+		std::lock_guard<std::mutex> lock{ loopTraceMutex };
+		if (loopTraceFile) fclose(loopTraceFile);
+		loopTraceFile = nullptr;
 	}
 
 	void MergeWorkerThreadStats()
 	{
-		std::unique_lock<std::mutex> lock{ workListMutex };
-		std::unique_lock<std::mutex> doneLock{ reportDoneMutex };
-		
-		// Set up state so that the worker threads will know that we would like them to report their
-		// thread-specific stats when they wake up.
-		reportWorkerStats = true;
-		reporterCount = threads.size();
-
-		// Wake up the worker threads.
-		workListCondition.notify_all();
-
-		// Wait for all of them to merge their stats.
-		reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
-
-		reportWorkerStats = false;
+		std::lock_guard<std::mutex> lock{ poolsMutex };
+		for (ThreadPool* pool : pools) pool->MergeWorkerThreadStats();
 	}
 
-} // namespace graphics
\ No newline at end of file
+} // namespace graphics
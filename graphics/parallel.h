@@ -6,9 +6,16 @@
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
 namespace graphics
 {
+	// A Float that threads can add to concurrently. Every Add() is a compare-exchange loop on the same word, so
+	// it only suits values that aren't added to by many threads at once; SplatBuffer is for those. The sum
+	// depends on the order in which the threads get to add, even with Options::deterministic.
 	class AtomicFloat
 	{
 	public:
@@ -57,14 +64,748 @@ namespace graphics
 		int count;
 	};
 
-	void ParallelFor(std::function<void(int64_t)> func, int64_t count, int chunkSize = 1);
+	// A barrier that a fixed number of threads can pass through any number of times, e.g. once per pass of a
+	// multi-pass algorithm, and that can live on the stack. Threads that arrive early spin for a little while
+	// before blocking, so that passes that are evenly balanced don't pay for going to sleep and waking up.
+	// All of the threads have to be running at once, so it's for threads of one's own, not for the bodies of
+	// parallel loops, whose iterations may well run one after another on the same thread.
+	class SpinBarrier
+	{
+	public:
+		explicit SpinBarrier(int count) : count{ count }, remaining{ count } { assert(count > 0); }
+		// Returns true in exactly one of the threads for each pass, the last one to arrive.
+		bool Wait();
+
+	private:
+		const int count;
+		std::atomic<int> remaining;
+		// Flipped by the last thread to arrive, which lets the others through. Comparing it to its value on
+		// arrival rather than to a fixed value is what makes the barrier reusable.
+		std::atomic<bool> sense{ false };
+		std::atomic<int> sleepers{ 0 };
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+
+	// Lets a loop be abandoned part way through, either explicitly or once a deadline has passed. Loops check
+	// the token before each chunk that they run, so they stop within about a chunk's worth of work of being
+	// cancelled. A token can be shared by any number of loops.
+	class CancellationToken
+	{
+	public:
+		CancellationToken() = default;
+		explicit CancellationToken(std::chrono::steady_clock::time_point deadline) : deadline{ deadline } {}
+		template <typename Rep, typename Period>
+		explicit CancellationToken(std::chrono::duration<Rep, Period> timeout)
+			: deadline{ std::chrono::steady_clock::now() + timeout }
+		{}
+
+		void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+		bool IsCancelled() const
+		{
+			return cancelled.load(std::memory_order_relaxed) ||
+				(deadline != std::chrono::steady_clock::time_point::max() &&
+				 std::chrono::steady_clock::now() >= deadline);
+		}
+
+	private:
+		std::atomic<bool> cancelled{ false };
+		const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	};
+
+	// Passing AutoChunkSize as a loop's chunkSize hands out large chunks first and smaller ones as the loop
+	// nears its end, never going below what the measured cost of an iteration makes worth scheduling.
+	static constexpr int AutoChunkSize = 0;
+
+	// Calls func(chunkBegin, chunkEnd) for disjoint sub-ranges that together cover [begin, end), in parallel.
+	// Sub-ranges are at least chunkSize long (except where the range runs out), and longer when there's no
+	// idle thread that needs the work. func is called through one indirection per sub-range, not per index.
+	// If numaNode isn't -1, only threads pinned to that node run the loop's iterations (see
+	// Options::threadAffinity), so memory they first touch is allocated on that node.
+	// func may itself start parallel loops. While waiting for one to finish, a thread helps with it and with
+	// whatever is nested inside of it, but never picks up iterations of an enclosing loop.
+	// With Options::deterministic, func is called for exactly the sub-ranges begin + k * chunkSize, however
+	// many threads there are, so that results that depend on how the range is cut up come out the same; with
+	// AutoChunkSize, chunkSize then depends only on the length of the range.
+	void ParallelForChunks(const std::function<void(int64_t, int64_t)>& func, int64_t begin, int64_t end,
+		int chunkSize = 1, int numaNode = -1);
+	// As above, but stops starting new chunks once cancel is cancelled. Returns the number of indices that
+	// were run; chunks that had already started run to completion.
+	int64_t ParallelForChunks(const std::function<void(int64_t, int64_t)>& func, int64_t begin, int64_t end,
+		const CancellationToken& cancel, int chunkSize = 1, int numaNode = -1);
+
+	// Calls func(i) for every i in [begin, end). The loop over a chunk's indices is instantiated here, so the
+	// body can be inlined into it.
+	template <typename F>
+	void ParallelForRange(F&& func, int64_t begin, int64_t end, int chunkSize = 1, int numaNode = -1)
+	{
+		ParallelForChunks([&func](int64_t chunkBegin, int64_t chunkEnd)
+			{
+				for (int64_t i = chunkBegin; i < chunkEnd; ++i) func(i);
+			}, begin, end, chunkSize, numaNode);
+	}
+
+	template <typename F>
+	void ParallelFor(F&& func, int64_t count, int chunkSize = 1, int numaNode = -1)
+	{
+		ParallelForRange(std::forward<F>(func), 0, count, chunkSize, numaNode);
+	}
+
+	template <typename F>
+	int64_t ParallelForRange(F&& func, int64_t begin, int64_t end, const CancellationToken& cancel,
+		int chunkSize = 1, int numaNode = -1)
+	{
+		return ParallelForChunks([&func](int64_t chunkBegin, int64_t chunkEnd)
+			{
+				for (int64_t i = chunkBegin; i < chunkEnd; ++i) func(i);
+			}, begin, end, cancel, chunkSize, numaNode);
+	}
+
+	template <typename F>
+	int64_t ParallelFor(F&& func, int64_t count, const CancellationToken& cancel, int chunkSize = 1,
+		int numaNode = -1)
+	{
+		return ParallelForRange(std::forward<F>(func), 0, count, cancel, chunkSize, numaNode);
+	}
+
+	// The index of the current thread within the thread pool it's a worker of, from 1 up; 0 for threads that
+	// aren't workers of any pool, such as the main thread.
 	extern thread_local int ThreadIndex;
-	void PrallelFor2D(std::function<void(Point2i)> func, const Point2i& count);
 	int MaxThreadIndex();
 	int NumSystemCores();
+
+	// A number for each running thread, from 0 up, that's unique across the process: unlike ThreadIndex, it
+	// tells apart the workers of different pools and the threads that aren't workers. A thread gets its
+	// number the first time it asks for one and gives it back when it exits, for another thread to reuse,
+	// so the numbers stay about as small as the number of threads that are running.
+	int GlobalThreadIndex();
+	// The calling thread's number, or -1 until it has asked for one; only for GlobalThreadIndex().
+	extern thread_local int globalThreadIndex;
+	int AssignGlobalThreadIndex();
+
+	inline int GlobalThreadIndex()
+	{
+		int index = globalThreadIndex;
+		return index >= 0 ? index : AssignGlobalThreadIndex();
+	}
+
+	// The order in which PrallelFor2D hands out the points of its domain. Workers take contiguous runs of
+	// this order, so with either curve each of them works on a compact block of neighbouring tiles rather than
+	// a run of scanlines.
+	enum class TileOrder { RowMajor, Morton, Hilbert };
+
+	// Returns the points of [0, count.x) x [0, count.y) in the given order.
+	std::vector<Point2i> TileOrderPoints(const Point2i& count, TileOrder order);
+
+	template <typename F>
+	void PrallelFor2D(F&& func, const Point2i& count, TileOrder order = TileOrder::RowMajor)
+	{
+		if (count.x <= 0 || count.y <= 0) return;
+		if (order == TileOrder::RowMajor)
+		{
+			const int nX = count.x;
+			ParallelForChunks([&func, nX](int64_t chunkBegin, int64_t chunkEnd)
+				{
+					for (int64_t i = chunkBegin; i < chunkEnd; ++i) func(Point2i(i % nX, i / nX));
+				}, 0, (int64_t)count.x * count.y);
+			return;
+		}
+
+		// The loop runs over the curve indices of the blocks that Bounds2iCurveIterator would visit, computing
+		// each point as it goes and skipping those past the edges of the domain.
+		const SpaceFillingCurve curve = (order == TileOrder::Morton) ? SpaceFillingCurve::Morton : SpaceFillingCurve::Hilbert;
+		const int side = CurveBlockSide(Vector2i(count.x, count.y));
+		const int nBlocksX = (count.x + side - 1) / side;
+		const int64_t blockSize = (int64_t)side * side;
+		const int64_t nIndices = nBlocksX * ((count.y + side - 1) / side) * blockSize;
+		ParallelForChunks([&func, count, curve, side, nBlocksX, blockSize](int64_t chunkBegin, int64_t chunkEnd)
+			{
+				for (int64_t i = chunkBegin; i < chunkEnd; ++i)
+				{
+					int block = int(i / blockSize);
+					Point2i pc = CurveToPoint(curve, side, uint32_t(i % blockSize));
+					Point2i p((block % nBlocksX) * side + pc.x, (block / nBlocksX) * side + pc.y);
+					if (p.x < count.x && p.y < count.y) func(p);
+				}
+			}, 0, nIndices);
+	}
+
+	// The measured cost of each tile of an image, kept from one pass of a progressive or multi-pass render to
+	// the next so that ParallelForTiles() can start the expensive tiles (glass, hair, ...) first.
+	class TileCosts
+	{
+	public:
+		TileCosts() = default;
+
+		// The number of tiles in x and y; zero until the first pass has run.
+		Point2i Count() const { return count; }
+		bool Measured() const { return count.x > 0 && count.y > 0; }
+		// The time that running a tile took in the last pass, all of its pieces together.
+		double Seconds(const Point2i& tile) const
+		{
+			return nanoseconds[tile.y * count.x + tile.x].load(std::memory_order_relaxed) / 1e9;
+		}
+		double TotalSeconds() const;
+
+		// Forgets the measurements and sets up the given number of tiles, all at zero cost.
+		void Reset(const Point2i& count);
+		// Adds to a tile's cost for the current pass.
+		void Add(const Point2i& tile, int64_t ns)
+		{
+			nanoseconds[tile.y * count.x + tile.x].fetch_add(ns, std::memory_order_relaxed);
+		}
+
+		// Writes the costs out as comma-separated milliseconds, a line per row of tiles, for inspection.
+		// Returns false if the file couldn't be written.
+		bool Write(const std::string& filename) const;
+
+	private:
+		Point2i count = Point2i(0, 0);
+		std::unique_ptr<std::atomic<int64_t>[]> nanoseconds;
+	};
+
+	// Calls func(tileBounds) for the tiles of pixelBounds, tileSize pixels on a side, in parallel, measuring how
+	// long each one takes into *costs if it's non-null. Once costs holds the times of a previous pass over
+	// the same tiles, tiles are started in order of decreasing cost, so that no expensive tile is left to
+	// run by itself at the end of the pass. Tiles whose cost makes up too large a share of what each thread
+	// has to do are split into smaller pieces first, unless Options::deterministic is set; func must then
+	// compute the same values for a pixel whatever the piece it's in, e.g. by seeding samplers per pixel.
+	// Without costs, or before the first pass, tiles are run in Hilbert curve order.
+	void ParallelForTiles(const std::function<void(const Bounds2i&)>& func, const Bounds2i& pixelBounds,
+		int tileSize, TileCosts* costs = nullptr);
+
+	// As above, for PrallelFor2D()'s tiles; tiles are given as points and never split.
+	template <typename F>
+	void PrallelFor2D(F&& func, const Point2i& count, TileCosts* costs)
+	{
+		Bounds2i bounds;
+		bounds.pMin = Point2i(0, 0);
+		bounds.pMax = count;
+		ParallelForTiles([&func](const Bounds2i& tile) { func(tile.pMin); }, bounds, 1, costs);
+	}
+
+	// Reductions and scans split [0, count) into blocks whose number and size depend only on count, never on the
+	// number of threads or on which thread runs what, and combine the per-block partial results in block
+	// order. Results are thus the same from run to run even when combine is only approximately associative,
+	// as with floating-point addition.
+	static constexpr int64_t MaxReduceBlocks = 1024;
+	static constexpr int64_t MinReduceBlockSize = 1024;
+
+	inline int64_t ReduceBlockSize(int64_t count)
+	{
+		return std::max(MinReduceBlockSize, (count + MaxReduceBlocks - 1) / MaxReduceBlocks);
+	}
+
+	// Returns combine(...combine(combine(identity, func(0)), func(1))..., func(count - 1)), computed in parallel.
+	// combine must be associative and identity must be its identity element.
+	template <typename T, typename F, typename C>
+	T ParallelReduce(int64_t count, const T& identity, F&& func, C&& combine)
+	{
+		int64_t blockSize = ReduceBlockSize(count);
+		int64_t nBlocks = (count + blockSize - 1) / blockSize;
+		std::vector<T> partials(nBlocks, identity);
+		ParallelFor([&](int64_t block)
+			{
+				int64_t end = std::min(count, (block + 1) * blockSize);
+				T partial = identity;
+				for (int64_t i = block * blockSize; i < end; ++i) partial = combine(partial, func(i));
+				partials[block] = partial;
+			}, nBlocks);
+
+		T result = identity;
+		for (const T& partial : partials) result = combine(result, partial);
+		return result;
+	}
+
+	// Writes the running combination of input[0..count) to output, computed in parallel; input and output may
+	// be the same array. With an inclusive scan output[i] includes input[i], with an exclusive one it only covers
+	// input[0..i) and output[0] is identity. Returns the combination of all of the input.
+	template <typename T, typename C>
+	T ParallelScan(const T* input, T* output, int64_t count, const T& identity, C&& combine, bool inclusive)
+	{
+		int64_t blockSize = ReduceBlockSize(count);
+		int64_t nBlocks = (count + blockSize - 1) / blockSize;
+
+		// Reduce each block, then turn the partials into each block's starting value.
+		std::vector<T> offsets(nBlocks, identity);
+		ParallelFor([&](int64_t block)
+			{
+				int64_t end = std::min(count, (block + 1) * blockSize);
+				T partial = identity;
+				for (int64_t i = block * blockSize; i < end; ++i) partial = combine(partial, input[i]);
+				offsets[block] = partial;
+			}, nBlocks);
+		T total = identity;
+		for (T& offset : offsets)
+		{
+			T partial = offset;
+			offset = total;
+			total = combine(total, partial);
+		}
+
+		// Scan each block starting from its offset.
+		ParallelFor([&](int64_t block)
+			{
+				int64_t end = std::min(count, (block + 1) * blockSize);
+				T sum = offsets[block];
+				for (int64_t i = block * blockSize; i < end; ++i)
+				{
+					T value = input[i];
+					if (inclusive)
+					{
+						sum = combine(sum, value);
+						output[i] = sum;
+					}
+					else
+					{
+						output[i] = sum;
+						sum = combine(sum, value);
+					}
+				}
+			}, nBlocks);
+		return total;
+	}
+
+	template <typename T, typename C = std::plus<T>>
+	T ParallelInclusiveScan(const T* input, T* output, int64_t count, const T& identity = T(), C&& combine = C())
+	{
+		return ParallelScan(input, output, count, identity, std::forward<C>(combine), true);
+	}
+
+	template <typename T, typename C = std::plus<T>>
+	T ParallelExclusiveScan(const T* input, T* output, int64_t count, const T& identity = T(), C&& combine = C())
+	{
+		return ParallelScan(input, output, count, identity, std::forward<C>(combine), false);
+	}
+
+	// Sorts *keys into ascending order with a parallel LSD radix sort on 8-bit digits, applying the same
+	// permutation to *values if it's non-null. The sort is stable. Keys must be unsigned integers; digits on
+	// which all of the keys agree (the high bytes of small keys, typically) cost a histogram pass but no
+	// scatter pass.
+	template <typename Key, typename Value>
+	void RadixSort(std::vector<Key>* keys, std::vector<Value>* values)
+	{
+		static_assert(std::is_unsigned<Key>::value, "RadixSort() requires unsigned integer keys");
+		constexpr int nBuckets = 256;
+		int64_t n = keys->size();
+		assert(!values || (int64_t)values->size() == n);
+		if (n < 2) return;
+
+		int64_t blockSize = std::max<int64_t>(1 << 16, (n + nBuckets - 1) / nBuckets);
+		int64_t nBlocks = (n + blockSize - 1) / blockSize;
+		std::vector<int64_t> offsets(nBlocks * nBuckets);
+		std::vector<Key> tempKeys(n);
+		std::vector<Value> tempValues(values ? n : 0);
+
+		for (int shift = 0; shift < 8 * (int)sizeof(Key); shift += 8)
+		{
+			// Count the keys in each bucket for each block.
+			std::fill(offsets.begin(), offsets.end(), 0);
+			ParallelFor([&](int64_t block)
+				{
+					int64_t* counts = &offsets[block * nBuckets];
+					int64_t end = std::min(n, (block + 1) * blockSize);
+					for (int64_t i = block * blockSize; i < end; ++i) ++counts[((*keys)[i] >> shift) & 0xff];
+				}, nBlocks);
+
+			// Turn the counts into where each block's keys from each bucket go: buckets in order, and within
+			// a bucket, blocks in order, which keeps the sort stable.
+			int64_t sum = 0;
+			bool oneBucket = false;
+			for (int bucket = 0; bucket < nBuckets; ++bucket)
+			{
+				int64_t bucketStart = sum;
+				for (int64_t block = 0; block < nBlocks; ++block)
+				{
+					int64_t count = offsets[block * nBuckets + bucket];
+					offsets[block * nBuckets + bucket] = sum;
+					sum += count;
+				}
+				if (sum - bucketStart == n) oneBucket = true;
+			}
+			if (oneBucket) continue;
+
+			ParallelFor([&](int64_t block)
+				{
+					int64_t* next = &offsets[block * nBuckets];
+					int64_t end = std::min(n, (block + 1) * blockSize);
+					for (int64_t i = block * blockSize; i < end; ++i)
+					{
+						int64_t to = next[((*keys)[i] >> shift) & 0xff]++;
+						tempKeys[to] = (*keys)[i];
+						if (values) tempValues[to] = (*values)[i];
+					}
+				}, nBlocks);
+			keys->swap(tempKeys);
+			if (values) values->swap(tempValues);
+		}
+	}
+
+	template <typename Key>
+	void RadixSort(std::vector<Key>* keys)
+	{
+		RadixSort(keys, (std::vector<uint8_t>*)nullptr);
+	}
+
+	// Accumulation
+
+	// A separate T for each thread, by GlobalThreadIndex(), so that threads can count, accumulate or keep
+	// scratch memory without sharing anything; the results are then combined once the parallel work is done.
+	// Any thread may use it, whichever pool it belongs to, if any. Values start out as a copy of the initial
+	// one, if given, and are allocated 64 at a time, as threads with higher numbers first ask for theirs. A thread that
+	// reuses the number of one that has exited carries on with its value. Each value has a cache line (or
+	// more) to itself.
+	template <typename T>
+	class PerThread
+	{
+	public:
+		PerThread() {}
+		explicit PerThread(const T& initial) : initialize([initial](T* value) { *value = initial; }) {}
+		~PerThread()
+		{
+			for (std::atomic<Slot*>& segment : segments) delete[] segment.load(std::memory_order_relaxed);
+		}
+		PerThread(const PerThread&) = delete;
+		PerThread& operator=(const PerThread&) = delete;
+
+		// The current thread's value.
+		T& Get()
+		{
+			int index = GlobalThreadIndex();
+			Slot* segment = segments[index / SegmentSlots].load(std::memory_order_acquire);
+			if (!segment) segment = allocateSegment(index / SegmentSlots);
+			return segment[index % SegmentSlots].value;
+		}
+
+		// The number of values allocated so far, which ForEach() and Combine() go through.
+		int Size() const
+		{
+			int n = 0;
+			for (const std::atomic<Slot*>& segment : segments)
+				if (segment.load(std::memory_order_acquire)) n += SegmentSlots;
+			return n;
+		}
+
+		// Calls func with each of the values allocated so far. Must not be called while any thread might be
+		// getting its value for the first time.
+		template <typename F>
+		void ForEach(F&& func)
+		{
+			for (std::atomic<Slot*>& s : segments)
+			{
+				Slot* segment = s.load(std::memory_order_acquire);
+				if (!segment) continue;
+				for (int i = 0; i < SegmentSlots; ++i) func(segment[i].value);
+			}
+		}
+
+		// Returns combine(...combine(combine(identity, value 0), value 1)..., value n - 1). Must not be called
+		// while any thread might be changing its value.
+		template <typename C>
+		T Combine(const T& identity, C&& combine) const
+		{
+			T result = identity;
+			for (const std::atomic<Slot*>& s : segments)
+			{
+				const Slot* segment = s.load(std::memory_order_acquire);
+				if (!segment) continue;
+				for (int i = 0; i < SegmentSlots; ++i) result = combine(result, segment[i].value);
+			}
+			return result;
+		}
+
+	private:
+		static constexpr int SegmentSlots = 64, MaxSegments = 64;
+
+		struct alignas(64) Slot
+		{
+			T value;
+		};
+
+		// Threads race to allocate a segment; the first to store it wins, and the others free theirs.
+		Slot* allocateSegment(int s)
+		{
+			assert(s < MaxSegments);
+			Slot* segment = new Slot[SegmentSlots]();
+			if (initialize)
+				for (int i = 0; i < SegmentSlots; ++i) initialize(&segment[i].value);
+			Slot* expected = nullptr;
+			if (segments[s].compare_exchange_strong(expected, segment, std::memory_order_acq_rel))
+				return segment;
+			delete[] segment;
+			return expected;
+		}
+
+		// Copies the initial value, if one was given; values are value-initialized otherwise.
+		const std::function<void(T*)> initialize;
+		std::atomic<Slot*> segments[MaxSegments] = {};
+	};
+
+	// Sums values that many threads add to the same elements of an array at once, such as the splats of
+	// light tracing piling up on a few bright pixels, where an AtomicFloat per element would have the threads
+	// fighting over the same cache lines and retrying their compare-exchanges. Each thread adds into buffers
+	// of its own instead, allocated only for the blocks of the array that it actually touches, and Merge()
+	// sums them into the array in parallel, at the end of a tile or a frame. T is the type that the sums are
+	// kept in, e.g. double so that small splats aren't lost when added to large sums. Add() may be called by
+	// any thread, as with PerThread.
+	// With Options::deterministic, Add() records each value instead, and Merge() adds an element's values in
+	// ascending order, so that its sum doesn't depend on which thread added what, at the cost of the memory
+	// for the values and of sorting them. T must then have operator<.
+	template <typename T = Float>
+	class SplatBuffer
+	{
+	public:
+		explicit SplatBuffer(int64_t size)
+			: size{ size }, nBlocks{ (size + BlockSize - 1) / BlockSize }, values(size),
+			  deterministic{ RayTracerOptions.deterministic }
+		{}
+
+		int64_t Size() const { return size; }
+
+		void Add(int64_t index, T value)
+		{
+			assert(index >= 0 && index < size);
+			if (deterministic)
+			{
+				std::vector<std::vector<Splat>>& blocks = threadSplats.Get();
+				if (blocks.empty()) blocks.resize(nBlocks);
+				blocks[index / BlockSize].push_back(Splat{ int(index % BlockSize), value });
+				return;
+			}
+			std::vector<std::unique_ptr<T[]>>& blocks = threadBlocks.Get();
+			if (blocks.empty()) blocks.resize(nBlocks);
+			std::unique_ptr<T[]>& block = blocks[index / BlockSize];
+			if (!block) block.reset(new T[BlockSize]());
+			block[index % BlockSize] += value;
+		}
+
+		// Adds everything that the threads have added since the last call to the array. Must not be called
+		// while any thread might be adding. Blocks that have been allocated are kept, zeroed, for next time.
+		void Merge()
+		{
+			if (deterministic)
+			{
+				mergeSorted();
+				return;
+			}
+			ParallelFor([&](int64_t b)
+				{
+					int64_t begin = b * BlockSize, n = std::min(size - begin, BlockSize);
+					threadBlocks.ForEach([&](std::vector<std::unique_ptr<T[]>>& blocks)
+						{
+							if (blocks.empty() || !blocks[b]) return;
+							T* block = blocks[b].get();
+							for (int64_t i = 0; i < n; ++i)
+							{
+								values[begin + i] += block[i];
+								block[i] = 0;
+							}
+						});
+				}, nBlocks, 16);
+		}
+
+		// Zeroes the sums and frees all of the threads' buffers.
+		void Clear()
+		{
+			std::fill(values.begin(), values.end(), T(0));
+			threadBlocks.ForEach([](std::vector<std::unique_ptr<T[]>>& blocks) { blocks.clear(); });
+			threadSplats.ForEach([](std::vector<std::vector<Splat>>& blocks) { blocks.clear(); });
+		}
+
+		// The sums as of the last Merge().
+		T operator[](int64_t index) const { return values[index]; }
+		const T* Data() const { return values.data(); }
+
+	private:
+		static constexpr int64_t BlockSize = 256;
+
+		struct Splat
+		{
+			int offset;
+			T value;
+		};
+
+		// Gathers each block's splats from all of the threads and adds them in order of element, then value.
+		// Blocks' splat arrays are emptied but keep their memory for next time.
+		void mergeSorted()
+		{
+			ParallelFor([&](int64_t b)
+				{
+					std::vector<Splat> splats;
+					threadSplats.ForEach([&](std::vector<std::vector<Splat>>& blocks)
+						{
+							if (blocks.empty()) return;
+							splats.insert(splats.end(), blocks[b].begin(), blocks[b].end());
+							blocks[b].clear();
+						});
+					std::sort(splats.begin(), splats.end(), [](const Splat& a, const Splat& b)
+						{
+							return a.offset < b.offset || (a.offset == b.offset && a.value < b.value);
+						});
+					for (const Splat& splat : splats) values[b * BlockSize + splat.offset] += splat.value;
+				}, nBlocks, 16);
+		}
+
+		const int64_t size, nBlocks;
+		std::vector<T> values;
+		const bool deterministic;
+		PerThread<std::vector<std::unique_ptr<T[]>>> threadBlocks;
+		PerThread<std::vector<std::vector<Splat>>> threadSplats;
+	};
+
+	template <typename T>
+	constexpr int64_t SplatBuffer<T>::BlockSize;
+
+	// Tasks
+
+	// A Task runs a function on one of the threads once all of the tasks it depends on have finished. Unlike
+	// ParallelFor(), spawning one doesn't block the caller, so independent stages can overlap.
+	class Task;
+
+	// Schedules func to run after every task in 'dependencies' has finished.
+	std::shared_ptr<Task> SpawnTask(std::function<void()> func,
+		const std::vector<std::shared_ptr<Task>>& dependencies = {});
+	bool TaskFinished(const std::shared_ptr<Task>& task);
+	// Runs other pending work (tasks and loop chunks) on the calling thread until 'task' has finished.
+	void WaitForTask(const std::shared_ptr<Task>& task);
+
+	// A Future refers to the result of a spawned function. Get() waits for it, and Then() schedules a
+	// continuation that's passed the result.
+	template <typename T>
+	class Future
+	{
+	public:
+		Future() = default;
+		Future(std::shared_ptr<Task> task, std::shared_ptr<std::unique_ptr<T>> value)
+			: task{ std::move(task) }, value{ std::move(value) }
+		{}
+		bool IsReady() const { return TaskFinished(task); }
+		void Wait() const { WaitForTask(task); }
+		const T& Get() const
+		{
+			Wait();
+			return **value;
+		}
+		template <typename F>
+		auto Then(F&& func) const -> Future<decltype(func(std::declval<const T&>()))>;
+
+		std::shared_ptr<Task> task;
+
+	private:
+		std::shared_ptr<std::unique_ptr<T>> value;
+	};
+
+	template <>
+	class Future<void>
+	{
+	public:
+		Future() = default;
+		explicit Future(std::shared_ptr<Task> task) : task{ std::move(task) } {}
+		bool IsReady() const { return TaskFinished(task); }
+		void Wait() const { WaitForTask(task); }
+		void Get() const { Wait(); }
+		template <typename F>
+		auto Then(F&& func) const -> Future<decltype(func())>;
+
+		std::shared_ptr<Task> task;
+	};
+
+	template <typename F>
+	Future<void> spawnFuture(F&& func, const std::vector<std::shared_ptr<Task>>& dependencies, std::true_type)
+	{
+		return Future<void>(SpawnTask(std::forward<F>(func), dependencies));
+	}
+
+	template <typename F>
+	auto spawnFuture(F&& func, const std::vector<std::shared_ptr<Task>>& dependencies, std::false_type)
+		-> Future<decltype(func())>
+	{
+		typedef decltype(func()) T;
+		std::shared_ptr<std::unique_ptr<T>> value = std::make_shared<std::unique_ptr<T>>();
+		std::shared_ptr<Task> task = SpawnTask([f = std::forward<F>(func), value]() mutable
+			{
+				value->reset(new T(f()));
+			}, dependencies);
+		return Future<T>(std::move(task), std::move(value));
+	}
+
+	// Runs func() asynchronously once all of 'dependencies' have finished.
+	template <typename F>
+	auto Spawn(F&& func, const std::vector<std::shared_ptr<Task>>& dependencies = {}) -> Future<decltype(func())>
+	{
+		return spawnFuture(std::forward<F>(func), dependencies, std::is_void<decltype(func())>());
+	}
+
+	template <typename T>
+	template <typename F>
+	auto Future<T>::Then(F&& func) const -> Future<decltype(func(std::declval<const T&>()))>
+	{
+		std::shared_ptr<std::unique_ptr<T>> v = value;
+		return Spawn([f = std::forward<F>(func), v]() mutable { return f(**v); }, { task });
+	}
+
+	template <typename F>
+	auto Future<void>::Then(F&& func) const -> Future<decltype(func())>
+	{
+		return Spawn(std::forward<F>(func), { task });
+	}
+
+	// Returns a Future that's ready once all of the given ones are.
+	template <typename... Futures>
+	Future<void> WhenAll(const Futures&... futures)
+	{
+		return Spawn([]() {}, { futures.task... });
+	}
+
+	template <typename T>
+	Future<void> WhenAll(const std::vector<Future<T>>& futures)
+	{
+		std::vector<std::shared_ptr<Task>> tasks;
+		for (const Future<T>& future : futures) tasks.push_back(future.task);
+		return Spawn([]() {}, tasks);
+	}
+
+	// Thread pools. ParallelInit() sets up a default pool of MaxThreadIndex() threads, the main thread
+	// included, on which all of the above run unless the current thread is told otherwise. Further pools
+	// have worker threads of their own, so work started on one of them doesn't wait behind work in another,
+	// and their threads can be given a lower or higher priority with the OS; for example background pools
+	// for MIP map generation and BVH rebuilds, that leave the default pool to interactive rendering. Work
+	// runs on the pool that it was started on, and loops and tasks started from within it run on that pool too.
+	enum class ThreadPriority { Background, Normal, Interactive };
+
+	class ThreadPool;
+
+	// Starts a pool with nThreads worker threads of the given priority. The pool must outlive any work that
+	// was started on it.
+	std::shared_ptr<ThreadPool> MakeThreadPool(int nThreads, ThreadPriority priority = ThreadPriority::Normal);
+	// The pool that work started by the current thread runs on.
+	ThreadPool* CurrentThreadPool();
+	// Makes the current thread start its work on 'pool' (or the default pool if null), and returns the pool it
+	// used before.
+	ThreadPool* SetCurrentThreadPool(ThreadPool* pool);
+
+	// Runs the parallel loops, reductions and tasks that the current thread starts in its scope on a given pool.
+	class ThreadPoolScope
+	{
+	public:
+		explicit ThreadPoolScope(ThreadPool* pool) : previous{ SetCurrentThreadPool(pool) } {}
+		~ThreadPoolScope() { SetCurrentThreadPool(previous); }
+		ThreadPoolScope(const ThreadPoolScope&) = delete;
+		ThreadPoolScope& operator=(const ThreadPoolScope&) = delete;
+
+	private:
+		ThreadPool* previous;
+	};
+
+	// The number of NUMA nodes the default pool's threads have been spread over, and the node of a given
+	// thread. Both report a single node unless ParallelInit() pinned the threads.
+	int NumaNodeCount();
+	int ThreadNumaNode(int threadIndex);
 	
 	void ParallelInit();
 	void ParallelCleanup();
+	// Has the worker threads of every pool report their stats. Workers that are in the middle of a task or a
+	// piece of a loop aren't waited for; they report once they've finished it, as they do when they exit.
 	void MergeWorkerThreadStats();
 
 } // namespace graphics
@@ -4,14 +4,31 @@
 #include <array>
 #include <atomic>
 #include <cinttypes>
+#include <deque>
 #include <functional>
 #include <mutex>
+#include <thread>
 #include <type_traits>
+#include "hashmap.h"
 #include "parallel.h"
 #include "stringprint.h"
 
+#if !defined(_MSC_VER) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
 #ifdef GRAPHICS_HAVE_ITIMER
-#include <sys/time.h>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <map>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+// Older C libraries only have the union member behind it.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 #endif // GRAPHICS_HAVE_ITIMER
 
 namespace graphics
@@ -33,6 +50,39 @@ namespace graphics
 		for (auto func : *funcs) func(accum);
 	}
 
+	// The titles of the stats of each type, by ID. Stats are registered during static initialization, so the
+	// table is created on first use rather than being a global of its own. Titles are kept in deques so that
+	// references to them stay valid when more are registered.
+	struct StatTitles
+	{
+		std::mutex mutex;
+		std::deque<std::string> titles[NumStatTypes];
+	};
+
+	static StatTitles& statTitles()
+	{
+		static StatTitles statTitles;
+		return statTitles;
+	}
+
+	int StatRegisterer::RegisterStat(StatType type, const char* title)
+	{
+		StatTitles& st = statTitles();
+		std::lock_guard<std::mutex> lock(st.mutex);
+		std::deque<std::string>& titles = st.titles[(int)type];
+		auto iter = std::find(titles.begin(), titles.end(), title);
+		if (iter != titles.end()) return int(iter - titles.begin());
+		titles.push_back(title);
+		return int(titles.size() - 1);
+	}
+
+	const std::string& StatRegisterer::StatTitle(StatType type, int id)
+	{
+		StatTitles& st = statTitles();
+		std::lock_guard<std::mutex> lock(st.mutex);
+		return st.titles[(int)type][id];
+	}
+
 	void PrintStats(FILE* dest) { statsAccumulator.Print(dest); }
 
 	void ClearStats() { statsAccumulator.Clear(); }
@@ -50,24 +100,53 @@ namespace graphics
 		}
 	}
 
+	template <typename T>
+	double StatsAccumulator::Distribution<T>::Percentile(double fraction) const
+	{
+		int64_t total = 0;
+		for (int64_t c : histogram) total += c;
+		int64_t rank = std::max((int64_t)1, (int64_t)std::ceil(fraction * total)), seen = 0;
+		for (int bucket = 0; bucket < (int)histogram.size(); ++bucket)
+		{
+			seen += histogram[bucket];
+			if (seen < rank) continue;
+			double end = std::is_integral<T>::value ? (double)StatHistogramIntBucketMax(bucket) :
+				StatHistogramFloatBucketEnd(bucket);
+			return std::min(std::max(end, (double)min), (double)max);
+		}
+		return max;
+	}
+
+	// Returns the IDs of the stats of the given type that have been reported, in order of title.
+	static std::vector<int> idsByTitle(StatType type, size_t nReported)
+	{
+		std::vector<int> ids(nReported);
+		for (size_t i = 0; i < nReported; ++i) ids[i] = int(i);
+		std::sort(ids.begin(), ids.end(), [type](int a, int b)
+			{
+				return StatRegisterer::StatTitle(type, a) < StatRegisterer::StatTitle(type, b);
+			});
+		return ids;
+	}
+
 	void StatsAccumulator::Print(FILE* dest)
 	{
 		fprintf(dest, "Statistics:\n");
 		std::map<std::string, std::vector<std::string>> toPrint;
 
-		for (auto& counter : counters)
+		for (int id : idsByTitle(StatType::Counter, counters.size()))
 		{
-			if (counter.second == 0) continue;
+			if (counters[id] == 0) continue;
 			std::string category, title;
-			getCategoryAndTitle(counter.first, &category, &title);
-			toPrint[category].push_back(StringPrintf("%-42s               %12" PRIu64, title.c_str(), counter.second));
+			getCategoryAndTitle(StatRegisterer::StatTitle(StatType::Counter, id), &category, &title);
+			toPrint[category].push_back(StringPrintf("%-42s               %12" PRIu64, title.c_str(), counters[id]));
 		}
-		for (auto& counter : memoryCounters)
+		for (int id : idsByTitle(StatType::MemoryCounter, memoryCounters.size()))
 		{
-			if (counter.second == 0) continue;
+			if (memoryCounters[id] == 0) continue;
 			std::string category, title;
-			getCategoryAndTitle(counter.first, &category, &title);
-			double kb = (double)counter.second / 1024;
+			getCategoryAndTitle(StatRegisterer::StatTitle(StatType::MemoryCounter, id), &category, &title);
+			double kb = (double)memoryCounters[id] / 1024;
 			if (kb < 1024.)
 				toPrint[category].push_back(StringPrintf("%-42s                  %9.2f MiB", title.c_str(), kb));
 			else
@@ -81,43 +160,50 @@ namespace graphics
 				}
 			}
 		}
-		for (auto& distributionSum : intDistributionSums)
+		for (int id : idsByTitle(StatType::IntDistribution, intDistributions.size()))
 		{
-			const std::string& name = distributionSum.first;
-			if (intDistributionCounts[name] == 0) continue;
+			const Distribution<int64_t>& d = intDistributions[id];
+			if (d.count == 0) continue;
 			std::string category, title;
-			getCategoryAndTitle(name, &category, &title);
-			double avg = (double)distributionSum.second / (double)intDistributionCounts[name];
-			toPrint[category].push_back(StringPrintf("%-42s                      %.3f avg [range %" PRIu64	" - %" PRIu64 "]",
-				title.c_str(), avg, intDistributionMins[name], intDistributionMaxs[name]));
+			getCategoryAndTitle(StatRegisterer::StatTitle(StatType::IntDistribution, id), &category, &title);
+			double avg = (double)d.sum / (double)d.count;
+			std::string line = StringPrintf("%-42s                      %.3f avg [range %" PRId64 " - %" PRId64 "]",
+				title.c_str(), avg, d.min, d.max);
+			if (!d.histogram.empty())
+				line += StringPrintf(" p50 %" PRId64 " p90 %" PRId64 " p99 %" PRId64, (int64_t)d.Percentile(.5),
+					(int64_t)d.Percentile(.9), (int64_t)d.Percentile(.99));
+			toPrint[category].push_back(line);
 		}
-		for (auto& distributionSum : floatDistributionSums)
+		for (int id : idsByTitle(StatType::FloatDistribution, floatDistributions.size()))
 		{
-			const std::string& name = distributionSum.first;
-			if (floatDistributionCounts[name] == 0) continue;
+			const Distribution<double>& d = floatDistributions[id];
+			if (d.count == 0) continue;
 			std::string category, title;
-			getCategoryAndTitle(name, &category, &title);
-			double avg = (double)distributionSum.second / (double)floatDistributionCounts[name];
-			toPrint[category].push_back(StringPrintf("%-42s                      %.3f avg [range %f - %f]",
-				title.c_str(), avg, floatDistributionMins[name], floatDistributionMaxs[name]));
+			getCategoryAndTitle(StatRegisterer::StatTitle(StatType::FloatDistribution, id), &category, &title);
+			double avg = d.sum / (double)d.count;
+			std::string line = StringPrintf("%-42s                      %.3f avg [range %f - %f]",
+				title.c_str(), avg, d.min, d.max);
+			if (!d.histogram.empty())
+				line += StringPrintf(" p50 %f p90 %f p99 %f", d.Percentile(.5), d.Percentile(.9), d.Percentile(.99));
+			toPrint[category].push_back(line);
 		}
-		for (auto& percentage : percentages)
+		for (int id : idsByTitle(StatType::Percentage, percentages.size()))
 		{
-			if (percentage.second.second == 0) continue;
-			int64_t num = percentage.second.first;
-			int64_t denom = percentage.second.second;
+			if (percentages[id].second == 0) continue;
+			int64_t num = percentages[id].first;
+			int64_t denom = percentages[id].second;
 			std::string category, title;
-			getCategoryAndTitle(percentage.first, &category, &title);
+			getCategoryAndTitle(StatRegisterer::StatTitle(StatType::Percentage, id), &category, &title);
 			toPrint[category].push_back(StringPrintf("%-42s%12" PRIu64 " / %12" PRIu64 " (%.2f%%)",
 				title.c_str(), num, denom, (100.f * num) / denom));
 		}
-		for (auto& ratio : ratios)
+		for (int id : idsByTitle(StatType::Ratio, ratios.size()))
 		{
-			if (ratio.second.second == 0) continue;
-			int64_t num = ratio.second.first;
-			int64_t denom = ratio.second.second;
+			if (ratios[id].second == 0) continue;
+			int64_t num = ratios[id].first;
+			int64_t denom = ratios[id].second;
 			std::string category, title;
-			getCategoryAndTitle(ratio.first, &category, &title);
+			getCategoryAndTitle(StatRegisterer::StatTitle(StatType::Ratio, id), &category, &title);
 			toPrint[category].push_back(StringPrintf("%-42s%12" PRIu64 " / %12" PRIu64 " (%.2fx)",
 				title.c_str(), num, denom, (double)num / (double)denom));
 		}
@@ -134,43 +220,385 @@ namespace graphics
 	{
 		counters.clear();
 		memoryCounters.clear();
-		intDistributionSums.clear();
-		intDistributionCounts.clear();
-		intDistributionMins.clear();
-		intDistributionMaxs.clear();
-		floatDistributionSums.clear();
-		floatDistributionCounts.clear();
-		floatDistributionMins.clear();
-		floatDistributionMaxs.clear();
+		intDistributions.clear();
+		floatDistributions.clear();
 		percentages.clear();
 		ratios.clear();
 	}
 
+	// The hardware counters that the profiler reads with Options::profileCounters.
+	enum ProfileCounter { CyclesCounter, InstructionsCounter, LLCMissesCounter, BranchMissesCounter, NumProfileCounters };
+
 	// For a given profiler state (i.e., a set of "on" bits corresponding to profiler catagories
 	// that are active), ProfileSample stores a count of the number of times that state has been
-	// active when the timer interrupt to record a profiling sample has fired.
+	// active when the timer interrupt to record a profiling sample has fired, and what the hardware
+	// counters counted in the threads that took those samples since their samples before.
 	struct ProfileSample
 	{
 		std::atomic<uint64_t> profilerState{ 0 };
 		std::atomic<uint64_t> count{ 0 };
+		std::atomic<uint64_t> counters[NumProfileCounters];
 	};
 
 	// Use a hash table to keep track of the profiler counts. Because dynamic memory allocation
 	// can't be done in a signal handler (and because the counts are updated in a signal handler),
 	// std::unordered_map can't easily be used. Therefore a fixed size hash table is allocated and
-	// linear probing used to resolve a conflict.
-	static const int profileHashSize = 256;
+	// linear probing used to resolve a conflict. Slots are claimed with a compare-exchange, since
+	// every thread takes its own samples.
+	static const int profileHashSize = 4096;
 	static std::array<ProfileSample, profileHashSize> profileSamples;
-
-	static std::chrono::system_clock::time_point profileStartTime;
+	// Samples that found the table full.
+	static std::atomic<uint64_t> profileSamplesDropped{ 0 };
 
 #ifdef GRAPHICS_HAVE_ITIMER
-	static void ReportProfileSample(int, sigingo_t*, void*);
+	static void ReportProfileSample(int, siginfo_t*, void*);
+
+	// Each thread that's sampled has its own timer, which counts the CPU time that the thread uses and
+	// sends the signal to that thread, rather than a process-wide one whose signals go to whichever
+	// thread the kernel picks. Timers are created by ProfilerWorkerThreadInit() and deleted when their
+	// thread exits; all of them are started and stopped together.
+	struct ProfilerThreadTimer
+	{
+		~ProfilerThreadTimer();
+
+		timer_t timer;
+		bool created = false;
+		pid_t tid;
+		// The thread's hardware counters, once Options::profileCounters has had them opened, in one group
+		// so that they count over the same time; -1 for those that couldn't be. They're only closed when the
+		// thread exits, since a signal that's on its way may still read them. lastCounts holds their values,
+		// scaled up for the time the group wasn't counting, at the thread's last sample.
+		std::atomic<int> counterFds[NumProfileCounters];
+		bool countersOpened = false;
+		uint64_t lastCounts[NumProfileCounters];
+	};
+
+	static thread_local ProfilerThreadTimer profilerThreadTimer;
+	// Guards profilerTimers and starting and stopping them.
+	static std::mutex profilerTimersMutex;
+	static std::vector<ProfilerThreadTimer*> profilerTimers;
+	// The rate the timers were last started at.
+	static int profileSampleRate = 100;
+	// Whether the counters were asked for when the profiler was last started, and which of them could be
+	// opened in any thread.
+	static bool profileCountersRequested = false;
+	static bool profileCounterOpened[NumProfileCounters];
+
+	static const uint64_t profileCounterConfigs[NumProfileCounters] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+	};
 #endif // GRAPHICS_HAVE_ITIMER
 
 	thread_local uint64_t ProfilerState;
 	static std::atomic<bool> profilerRunning{ false };
 
+#ifdef GRAPHICS_HAVE_ITIMER
+	// Starts a thread's timer at profileSampleRate samples per second of CPU time, or stops it.
+	static void setProfilerTimer(timer_t timer, bool run)
+	{
+		struct itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		if (run)
+		{
+			spec.it_interval.tv_sec = 0;
+			spec.it_interval.tv_nsec = 1000000000L / profileSampleRate;
+			spec.it_value = spec.it_interval;
+		}
+		int err = timer_settime(timer, 0, &spec, NULL);
+		assert(err == 0);
+		(void)err;
+		// TODO: This message needs to go to a log if the above assertion fails:
+		// "Timer could not be set: " << strerror(errno);
+	}
+
+	// Returns the file descriptor that the group of a thread's counters is read and controlled through.
+	static int profileCounterLeader(const ProfilerThreadTimer& t)
+	{
+		for (const std::atomic<int>& fd : t.counterFds)
+			if (fd.load(std::memory_order_relaxed) >= 0) return fd.load(std::memory_order_relaxed);
+		return -1;
+	}
+
+	// Opens a thread's counters, or resets them if they're open, and sets them counting. Called with
+	// profilerTimersMutex held and the thread's timer stopped.
+	static void startProfileCounters(ProfilerThreadTimer* t)
+	{
+		if (!t->countersOpened)
+		{
+			int leader = -1;
+			for (int c = 0; c < NumProfileCounters; ++c)
+			{
+				struct perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = profileCounterConfigs[c];
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				// The times let counts be scaled up when the kernel has to share the hardware between more
+				// counters than it has, and only counts some of them at a time.
+				attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+				int fd = (int)syscall(SYS_perf_event_open, &attr, t->tid, -1, leader, PERF_FLAG_FD_CLOEXEC);
+				t->counterFds[c].store(fd, std::memory_order_relaxed);
+				if (fd >= 0 && leader < 0) leader = fd;
+				// TODO: This message needs to go to a log if fd < 0:
+				// "Hardware counter could not be opened: " << strerror(errno);
+			}
+			t->countersOpened = true;
+		}
+		int leader = profileCounterLeader(*t);
+		if (leader < 0) return;
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		for (int c = 0; c < NumProfileCounters; ++c)
+		{
+			t->lastCounts[c] = 0;
+			if (t->counterFds[c].load(std::memory_order_relaxed) >= 0) profileCounterOpened[c] = true;
+		}
+	}
+
+	// Charges what the calling thread's counters have counted since its last sample to 'sample', if it isn't
+	// null. Called from the signal handler.
+	static void readProfileCounters(ProfileSample* sample)
+	{
+		ProfilerThreadTimer& t = profilerThreadTimer;
+		int leader = profileCounterLeader(t);
+		if (leader < 0) return;
+		// The number of counters in the group, the time that the group was enabled for and the time it was
+		// actually counting for, and then the counters' values in the order they were opened in.
+		uint64_t values[3 + NumProfileCounters];
+		if (read(leader, values, sizeof(values)) < (ssize_t)(3 * sizeof(uint64_t))) return;
+		uint64_t enabled = values[1], running = values[2];
+		if (running == 0) return;
+		double scale = running < enabled ? double(enabled) / running : 1.;
+		for (int c = 0, v = 3; c < NumProfileCounters && v < 3 + (int)values[0]; ++c)
+		{
+			if (t.counterFds[c].load(std::memory_order_relaxed) < 0) continue;
+			// Scaled counts are estimates, and may come out below the last one.
+			uint64_t count = std::max(uint64_t(values[v++] * scale), t.lastCounts[c]);
+			if (sample) sample->counters[c].fetch_add(count - t.lastCounts[c], std::memory_order_relaxed);
+			t.lastCounts[c] = count;
+		}
+	}
+
+	// Creates the calling thread's timer, if it doesn't have one yet, and starts it if the profiler is running.
+	static void createProfilerThreadTimer()
+	{
+		if (profilerThreadTimer.created) return;
+		profilerThreadTimer.tid = (pid_t)syscall(SYS_gettid);
+		for (std::atomic<int>& fd : profilerThreadTimer.counterFds) fd = -1;
+		struct sigevent sev;
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGPROF;
+		sev.sigev_notify_thread_id = profilerThreadTimer.tid;
+		if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &profilerThreadTimer.timer) != 0)
+		{
+			// TODO: This message needs to go to a log:
+			// "Profiler timer could not be created: " << strerror(errno);
+			return;
+		}
+		profilerThreadTimer.created = true;
+
+		std::lock_guard<std::mutex> lock{ profilerTimersMutex };
+		profilerTimers.push_back(&profilerThreadTimer);
+		if (profilerRunning)
+		{
+			if (profileCountersRequested) startProfileCounters(&profilerThreadTimer);
+			setProfilerTimer(profilerThreadTimer.timer, true);
+		}
+	}
+
+	ProfilerThreadTimer::~ProfilerThreadTimer()
+	{
+		if (!created) return;
+		std::lock_guard<std::mutex> lock{ profilerTimersMutex };
+		profilerTimers.erase(std::find(profilerTimers.begin(), profilerTimers.end(), this));
+		timer_delete(timer);
+		for (std::atomic<int>& fd : counterFds)
+		{
+			int f = fd.exchange(-1);
+			if (f >= 0) close(f);
+		}
+	}
+#endif // GRAPHICS_HAVE_ITIMER
+
+	// Each thread records its profiler phases in a buffer of its own, which it allocates the first time it
+	// records something in a trace. A buffer that fills up wraps around, so that the last profileTraceEvents
+	// are kept. Buffers are freed once the trace has been written; those of threads that exit while tracing
+	// are kept until then.
+	struct ProfileTraceEvent
+	{
+		uint64_t timestamp;
+		uint64_t bits;
+		bool begin;
+	};
+
+	static constexpr int profileTraceEvents = 1 << 15;
+
+	struct ProfileTraceBuffer
+	{
+		// ThreadIndex of the thread when it created the buffer.
+		int threadIndex;
+		// The number of events recorded; only the owning thread writes it.
+		std::atomic<uint64_t> head{ 0 };
+		ProfileTraceEvent events[profileTraceEvents];
+	};
+
+	// The calling thread's side of tracing, registered in profileTraceWriters for as long as the thread runs.
+	struct ProfileTraceWriter
+	{
+		ProfileTraceWriter();
+		~ProfileTraceWriter();
+
+		// Set while the thread records an event, so that the trace isn't written (and the buffer freed)
+		// under it.
+		std::atomic<bool> writing{ false };
+		std::unique_ptr<ProfileTraceBuffer> buffer;
+	};
+
+	std::atomic<bool> ProfileTracing{ false };
+	static thread_local ProfileTraceWriter profileTraceWriter;
+	// Guards profileTraceWriters and profileTraceFinished.
+	static std::mutex profileTraceMutex;
+	static std::vector<ProfileTraceWriter*> profileTraceWriters;
+	// The buffers of threads that exited during the current trace.
+	static std::vector<std::unique_ptr<ProfileTraceBuffer>> profileTraceFinished;
+	// The time stamp counter and the clock when tracing started, from which the counter's rate is worked out
+	// when the trace is written. The counter runs at a fixed rate on the processors we render on.
+	static uint64_t profileTraceStartTicks;
+	static std::chrono::steady_clock::time_point profileTraceStartTime;
+
+	ProfileTraceWriter::ProfileTraceWriter()
+	{
+		std::lock_guard<std::mutex> lock{ profileTraceMutex };
+		profileTraceWriters.push_back(this);
+	}
+
+	ProfileTraceWriter::~ProfileTraceWriter()
+	{
+		std::lock_guard<std::mutex> lock{ profileTraceMutex };
+		profileTraceWriters.erase(std::find(profileTraceWriters.begin(), profileTraceWriters.end(), this));
+		if (buffer && ProfileTracing) profileTraceFinished.push_back(std::move(buffer));
+	}
+
+	static inline uint64_t profileTraceTicks()
+	{
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || \
+	(!defined(_MSC_VER) && (defined(__x86_64__) || defined(__i386__)))
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	void TraceProfilePhases(uint64_t bits, bool begin)
+	{
+		ProfileTraceWriter& writer = profileTraceWriter;
+		// Pairs with stopProfileTrace(), which clears ProfileTracing before it waits for writing to be
+		// cleared: either this sees that tracing has stopped, or the trace waits for this event.
+		writer.writing.store(true);
+		if (ProfileTracing.load())
+		{
+			if (!writer.buffer)
+			{
+				writer.buffer.reset(new ProfileTraceBuffer);
+				writer.buffer->threadIndex = ThreadIndex;
+			}
+			ProfileTraceBuffer* buffer = writer.buffer.get();
+			uint64_t head = buffer->head.load(std::memory_order_relaxed);
+			buffer->events[head & (profileTraceEvents - 1)] = ProfileTraceEvent{ profileTraceTicks(), bits, begin };
+			buffer->head.store(head + 1, std::memory_order_release);
+		}
+		writer.writing.store(false, std::memory_order_release);
+	}
+
+	static void startProfileTrace()
+	{
+		profileTraceStartTime = std::chrono::steady_clock::now();
+		profileTraceStartTicks = profileTraceTicks();
+		ProfileTracing = true;
+		// The calling thread's categories have started already.
+		if (ProfilerState) TraceProfilePhases(ProfilerState, true);
+	}
+
+	// Writes one event per category, with those that begin in the order in which Prof lists them and those
+	// that end in reverse, so that the events of each thread nest. Ends whose beginning has been overwritten
+	// are left out, and whatever hasn't ended by 'end' is ended then.
+	static void writeProfileTrace(FILE* f, int tid, const ProfileTraceBuffer& buffer, uint64_t end,
+		double ticksPerMicrosecond, bool* first)
+	{
+		auto writeEvent = [&](const char* name, bool begin, uint64_t ticks)
+		{
+			double us = ticks < profileTraceStartTicks ? 0. : (ticks - profileTraceStartTicks) / ticksPerMicrosecond;
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d}",
+				*first ? "" : ",", name, begin ? "B" : "E", us, tid);
+			*first = false;
+		};
+
+		uint64_t head = buffer.head.load(std::memory_order_acquire);
+		uint64_t start = head > profileTraceEvents ? head - profileTraceEvents : 0;
+		if (head == start) return;
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+			"\"args\":{\"name\":\"Thread %d (ThreadIndex %d)\"}}", *first ? "" : ",", tid, tid, buffer.threadIndex);
+		*first = false;
+
+		// The categories that have begun and not ended yet, innermost last.
+		std::vector<int> open;
+		for (uint64_t i = start; i < head; ++i)
+		{
+			const ProfileTraceEvent& e = buffer.events[i & (profileTraceEvents - 1)];
+			for (int b = 0; b < (int)Prof::NumProfCategories; ++b)
+			{
+				int category = e.begin ? b : (int)Prof::NumProfCategories - 1 - b;
+				if (!(e.bits & (1ull << category))) continue;
+				if (e.begin)
+					open.push_back(category);
+				else if (open.empty())
+					continue;
+				else
+					open.pop_back();
+				writeEvent(ProfNames[category], e.begin, e.timestamp);
+			}
+		}
+		for (; !open.empty(); open.pop_back()) writeEvent(ProfNames[open.back()], false, end);
+	}
+
+	static void stopProfileTrace()
+	{
+		// Holding the mutex keeps threads from starting or exiting while their buffers are written.
+		std::lock_guard<std::mutex> lock{ profileTraceMutex };
+		ProfileTracing = false;
+		for (ProfileTraceWriter* writer : profileTraceWriters)
+			while (writer->writing.load(std::memory_order_acquire)) std::this_thread::yield();
+
+		uint64_t endTicks = profileTraceTicks();
+		double us = std::chrono::duration<double, std::micro>(
+			std::chrono::steady_clock::now() - profileTraceStartTime).count();
+		double ticksPerMicrosecond = std::max(endTicks - profileTraceStartTicks, (uint64_t)1) / std::max(us, 1.);
+
+		FILE* f = fopen(RayTracerOptions.profileTraceFile.c_str(), "w");
+		if (f)
+		{
+			fprintf(f, "{\"traceEvents\":[");
+			bool first = true;
+			int tid = 0;
+			for (ProfileTraceWriter* writer : profileTraceWriters)
+				if (writer->buffer)
+					writeProfileTrace(f, tid++, *writer->buffer, endTicks, ticksPerMicrosecond, &first);
+			for (const std::unique_ptr<ProfileTraceBuffer>& buffer : profileTraceFinished)
+				writeProfileTrace(f, tid++, *buffer, endTicks, ticksPerMicrosecond, &first);
+			fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+			fclose(f);
+		}
+		// TODO: This message needs to go to a log if !f:
+		// "Couldn't open profile trace file: " << strerror(errno);
+
+		for (ProfileTraceWriter* writer : profileTraceWriters) writer->buffer.reset();
+		profileTraceFinished.clear();
+	}
+
 	void InitProfiler()
 	{
 		assert(!profilerRunning);
@@ -181,9 +609,9 @@ namespace graphics
 		ProfilerState = ProfToBits(Prof::SceneConstruction);
 		
 		ClearProfiler();
-		profileStartTime = std::chrono::system_clock::now();
+		if (!RayTracerOptions.profileTraceFile.empty()) startProfileTrace();
 
-		// Set timer to periodically interrupt the system for profiling
+		// Set the timers to periodically interrupt the threads for profiling
 #ifdef GRAPHICS_HAVE_ITIMER
 		struct sigaction sa;
 		memset(&sa, 0, sizeof(sa));
@@ -192,14 +620,17 @@ namespace graphics
 		sigemptyset(&sa.sa_mask);
 		sigaction(SIGPROF, &sa, NULL);
 
-		static struct itimerval timer;
-		timer.it_interval.tv_sec = 0;
-		timer.it_interval.tv_usec = 1000000 / 100; // 100 Hz sampling
-		timer.it_value = timer.it_interval;
-
-		assert(settimer(ITIMER_PROF, &timer, NULL) == 0);
-		// TODO: This message needs to go to a log if the above assertion fails:
-		// "Timer could not be initialized: " << strerror(errno);
+		createProfilerThreadTimer();
+		// Threads that create their timers from now on start them themselves.
+		std::lock_guard<std::mutex> lock{ profilerTimersMutex };
+		profileSampleRate = std::max(1, std::min(RayTracerOptions.profileSampleRate, 1000000));
+		profileCountersRequested = RayTracerOptions.profileCounters;
+		std::fill(profileCounterOpened, profileCounterOpened + NumProfileCounters, false);
+		for (ProfilerThreadTimer* t : profilerTimers)
+		{
+			if (profileCountersRequested) startProfileCounters(t);
+			setProfilerTimer(t->timer, true);
+		}
 #endif // GRAPHICS_HAVE_ITIMER
 
 		profilerRunning = true;
@@ -214,14 +645,14 @@ namespace graphics
 	void ProfilerWorkerThreadInit()
 	{
 #ifdef GRAPHICS_HAVE_ITIMER
-		// The per-thread initialization in the worker threads has to happen *before* the profiling
-		// signal handler is installed.
-		assert(!profilerRunning || profilerSuspendCount > 0);
-		
+		// Threads may start while the profiler is running, as when a thread pool is made mid-render; the
+		// thread's own timer, which is the only one that interrupts it, isn't created until the end of this.
+		//
 		// ProfilerState is a thread-local variable that is accessed in the profiler signal handler.
 		// It's important to access it here, which causes the dynamic memory allocation for the
 		// thread local storage to happen now, rather than in the signal handler, where this isn't allowed.
 		ProfilerState = ProfToBits(Prof::SceneConstruction);
+		createProfilerThreadTimer();
 #endif // GRAPHICS_HAVE_ITIMER
 	}
 
@@ -231,52 +662,62 @@ namespace graphics
 		{
 			ps.profilerState = 0;
 			ps.count = 0;
+			for (std::atomic<uint64_t>& c : ps.counters) c = 0;
 		}
+		profileSamplesDropped = 0;
 	}
 
 	void CleanupProfiler()
 	{
 #ifdef GRAPHICS_HAVE_ITIMER
-		static struct itimerval timer;
-		timer.it_interval.tv_sec = 0;
-		timer.it_interval.tv_usec = 0;
-		timer.it_value = timer.it_interval;
-		assert(settimer(ITIMER_PROF, &timer, NULL) == 0);
-		// TODO: This message needs to go to a log if the above assertion failes:
-		// "Timer could not be disabled: " << strerror(errno)
+		std::lock_guard<std::mutex> lock{ profilerTimersMutex };
+		for (ProfilerThreadTimer* t : profilerTimers)
+		{
+			setProfilerTimer(t->timer, false);
+			int leader = profileCounterLeader(*t);
+			if (leader >= 0) ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		}
 #endif // GRAPHICS_HAVE_ITIMER
 		profilerRunning = false;
+		if (ProfileTracing) stopProfileTrace();
 	}
 
 #ifdef GRAPHICS_HAVE_ITIMER
-	static void ReportProfileSample(int, siginfo_t*, void*)
+	static void ReportProfileSample(int, siginfo_t* info, void*)
 	{
 		if (profilerSuspendCount > 0) return;
-		if (ProfilerState == 0) return; // A ProgressReporter thread, most likely.
-
-		uint64_t h = std::hash<uint64_t>{}(ProfilerState) % (profileHashSize - 1);
-		int count = 0;
-		while (count < profileHashSize &&
-			profileSamples[h].profilerState != ProfilerState &&
-			profileSamples[h].profilerState != 0)
+		uint64_t state = ProfilerState;
+		if (state == 0) return; // A ProgressReporter thread, most likely.
+		// CPU-time timers are only checked at scheduler ticks, so at rates above the tick rate a signal
+		// stands for several periods; the ones that didn't get a signal of their own are the overrun.
+		uint64_t samples = 1 + std::max(info->si_overrun, 0);
+
+		uint64_t h = MixBits(state) & (profileHashSize - 1);
+		for (int i = 0; i < profileHashSize; ++i, h = (h + 1) & (profileHashSize - 1))
 		{
-			// Wrap arond to the start if we hit the end.
-			if (++h == profileHashSize) h = 0;
-			++count;
+			ProfileSample& ps = profileSamples[h];
+			uint64_t s = ps.profilerState.load(std::memory_order_relaxed);
+			// If the slot is free, take it; s is left holding the state of whichever thread got there first.
+			if (s == 0 && ps.profilerState.compare_exchange_strong(s, state, std::memory_order_relaxed)) s = state;
+			if (s == state)
+			{
+				ps.count.fetch_add(samples, std::memory_order_relaxed);
+				readProfileCounters(&ps);
+				return;
+			}
 		}
-		assert(count != profileHashSize);
-		// TODO: On assertion failure, log this message: "Profiler hash table filled up!"
-		profileSamples[h].profilerState = ProfilerState;
-		++profileSamples[h].count;
+		// The count is printed with the results.
+		profileSamplesDropped.fetch_add(samples, std::memory_order_relaxed);
+		readProfileCounters(nullptr);
 	}
 #endif // GRAPHICS_HAVE_ITIMER
 
-	static std::string timeString(float pct, std::chrono::system_clock::time_point now)
+#ifdef GRAPHICS_HAVE_ITIMER
+	// Each sample stands for 1 / profileSampleRate seconds of CPU time in one thread.
+	static std::string timeString(uint64_t samples)
 	{
-		pct /= 100; // remap passed value to [0, 1];
-		int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - profileStartTime).count();
 		// milliseconds for this category
-		int64_t ms = int64_t(ns * pct / 1000000.);
+		int64_t ms = int64_t(samples * 1000. / profileSampleRate);
 		// Peel off hours, minutes, seconds, and remaining milliseconds
 		int h = ms / (3600 * 1000);
 		ms -= h * 3600 * 1000;
@@ -287,11 +728,42 @@ namespace graphics
 		ms /= 10; // only printing two digits of fractional seconds
 		return StringPrintf("%4d:%02d:%02d.%02d", h, m, s, ms);
 	}
+#endif // GRAPHICS_HAVE_ITIMER
+
+#ifdef GRAPHICS_HAVE_ITIMER
+	// What's added up for each line of the results.
+	struct ProfileResult
+	{
+		void Add(const ProfileSample& ps)
+		{
+			samples += ps.count;
+			for (int c = 0; c < NumProfileCounters; ++c) counters[c] += ps.counters[c];
+		}
+
+		uint64_t samples = 0;
+		uint64_t counters[NumProfileCounters] = {};
+	};
+
+	// Instructions per cycle, and last-level cache and branch misses per thousand instructions, as far as
+	// the counters they're worked out from could be opened.
+	static std::string counterString(const ProfileResult& r)
+	{
+		if (!profileCountersRequested) return "";
+		auto ratio = [&r](int num, int denom, double scale)
+		{
+			if (!profileCounterOpened[num] || !profileCounterOpened[denom] || r.counters[denom] == 0)
+				return std::string("      -");
+			return StringPrintf("%7.2f", scale * r.counters[num] / r.counters[denom]);
+		};
+		return " IPC" + ratio(InstructionsCounter, CyclesCounter, 1) +
+			"  LLC/ki" + ratio(LLCMissesCounter, InstructionsCounter, 1000) +
+			"  br/ki" + ratio(BranchMissesCounter, InstructionsCounter, 1000);
+	}
+#endif // GRAPHICS_HAVE_ITIMER
 
 	void ReportProfilerResults(FILE* dest)
 	{
 #ifdef GRAPHICS_HAVE_ITIMER
-		std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
 		constexpr int NumProfCategories = (int)Prof::NumProfCategories;
 		uint64_t overallCount = 0;
 		int used = 0;
@@ -305,8 +777,8 @@ namespace graphics
 		}
 		// TODO: std::cout?
 		//std::cout << "Used " << used << " / " << profileHashSize << " entries in profiler hash table";
-		std::map<std::string, uint64_t> flatResults;
-		std::map<std::string, uint64_t> hierarchicalResults;
+		std::map<std::string, ProfileResult> flatResults;
+		std::map<std::string, ProfileResult> hierarchicalResults;
 		for (const ProfileSample& ps : profileSamples)
 		{
 			if (ps.count == 0) continue;
@@ -318,48 +790,69 @@ namespace graphics
 					if (s.size() > 0)
 					{
 						// contribute to parents...
-						hierarchicalResults[s] += ps.count;
+						hierarchicalResults[s].Add(ps);
 						s += "/";
 					}
 					s += ProfNames[b];
 				}
 			}
-			hierarchicalResults[s] += ps.count;
+			hierarchicalResults[s].Add(ps);
 			int nameIndex = Log2Int(ps.profilerState);
 			assert(nameIndex < NumProfCategories);
-			flatResults[ProfNames[nameIndex]] += ps.count;
+			flatResults[ProfNames[nameIndex]].Add(ps);
 		}
 
-		fprintf(dest, "  Profile\n");
+		if (overallCount == 0) return;
+
+		fprintf(dest, "  Profile (CPU time over all threads: %s, %d samples/s per thread)\n",
+			timeString(overallCount).c_str(), profileSampleRate);
+		uint64_t dropped = profileSamplesDropped.load(std::memory_order_relaxed);
+		if (dropped > 0)
+			fprintf(dest, "    %" PRIu64 " samples dropped: more than %d distinct profiler states\n", dropped,
+				profileHashSize);
+		if (profileCountersRequested)
+		{
+			if (std::find(profileCounterOpened, profileCounterOpened + NumProfileCounters, true) ==
+				profileCounterOpened + NumProfileCounters)
+				fprintf(dest, "    Hardware counters could not be opened\n");
+			else
+				fprintf(dest, "    IPC: instructions per cycle; LLC/ki, br/ki: last-level cache and branch misses "
+					"per 1000 instructions\n");
+		}
 		for (const auto& r : hierarchicalResults)
 		{
-			float pct = (100.f * r.second) / overallCount;
+			float pct = (100.f * r.second.samples) / overallCount;
 			int indent = 4;
-			int slashIndex = r.first.find_last_of("/");
-			if (slashIndex == std::string::npos)
-				slashIndex = -1;
-			else
-				indent += 2 * std::count(r.first.begin(), r.first.end(), '/');
+			size_t lastSlash = r.first.find_last_of("/");
+			int slashIndex = -1;
+			if (lastSlash != std::string::npos)
+			{
+				slashIndex = int(lastSlash);
+				indent += 2 * int(std::count(r.first.begin(), r.first.end(), '/'));
+			}
 			const char* toPrint = r.first.c_str() + slashIndex + 1;
-			fprintf(dest, "%*c%s%*c %5.2f%% (%s)\n", indent, ' ', toPrint,
-				std::max(0, int(67 - strlen(toPrint) - indent)), ' ', pct, timeString(pct, now).c_str());
+			fprintf(dest, "%*c%s%*c %5.2f%% (%s)%s\n", indent, ' ', toPrint,
+				std::max(0, int(67 - strlen(toPrint) - indent)), ' ', pct, timeString(r.second.samples).c_str(),
+				counterString(r.second).c_str());
 		}
 
 		// Sort flattened ones by time, longest to shortest.
-		std::vector<std::pair<std::string, uint64_t>> flatVec;
+		std::vector<std::pair<std::string, ProfileResult>> flatVec;
 		for (const auto& r : flatResults)
 			flatVec.push_back(std::make_pair(r.first, r.second));
 		std::sort(flatVec.begin(), flatVec.end(),
-			[](std::pair<std::string, uint64_t> a, std::pair<std::string, uint64_t> b) { return a.second > b.second; });
+			[](const std::pair<std::string, ProfileResult>& a, const std::pair<std::string, ProfileResult>& b)
+			{ return a.second.samples > b.second.samples; });
 
 		fprintf(dest, "  Profile (flattened)\n");
 		for (const auto& r : flatVec)
 		{
-			float pct = (100.f * r.second) / overallCount;
+			float pct = (100.f * r.second.samples) / overallCount;
 			int indent = 4;
 			const char* toPrint = r.first.c_str();
-			fprintf(dest, "%*c%s%*c %5.2f%% (%s)\n", indent, ' ', toPrint,
-				std::max(0, int(67 - strlen(toPrint) - indent)), ' ', pct, timeString(pct, now).c_str());
+			fprintf(dest, "%*c%s%*c %5.2f%% (%s)%s\n", indent, ' ', toPrint,
+				std::max(0, int(67 - strlen(toPrint) - indent)), ' ', pct, timeString(r.second.samples).c_str(),
+				counterString(r.second).c_str());
 		}
 		fprintf(dest, "\n");
 #endif // GRAPHICS_HAVE_ITIMER
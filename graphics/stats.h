@@ -1,6 +1,8 @@
 #pragma once
 
 #include "graphics.h"
+#include <atomic>
+#include <climits>
 #include <map>
 #include <chrono>
 #include <string>
@@ -10,6 +12,10 @@
 namespace graphics
 {
 	class StatsAccumulator;
+
+	enum class StatType { Counter, MemoryCounter, IntDistribution, FloatDistribution, Percentage, Ratio };
+	static constexpr int NumStatTypes = 6;
+
 	class StatRegisterer
 	{
 	public:
@@ -23,6 +29,13 @@ namespace graphics
 		}
 		static void CallCallbacks(StatsAccumulator& accum);
 
+		// Returns the ID that a stat of the given type and title is reported under. IDs are small integers,
+		// handed out in order separately for each type, so that StatsAccumulator can keep the values in
+		// arrays; titles are only looked at again when printing. Registering the same title twice gives
+		// the same ID, so that the values are added up.
+		static int RegisterStat(StatType type, const char* title);
+		static const std::string& StatTitle(StatType type, int id);
+
 	private:
 		static std::vector<std::function<void(StatsAccumulator&)>>* funcs;
 	};
@@ -31,156 +44,237 @@ namespace graphics
 	void ClearStats();
 	void ReportThreadStats();
 
+	// Distributions keep a histogram of their values as well, so that percentiles can be printed. Buckets are
+	// spaced logarithmically, as in HdrHistogram: each power of two is split into 2^StatHistogramSubBucketBits
+	// buckets, so a percentile read off the histogram is at most a quarter above the true value. Int values
+	// are bucketed from 1 up, with one bucket for each of the smallest of them; float values from
+	// 2^StatHistogramMinExponent up. Values below the range, zero and negative ones included, are counted in
+	// the first bucket and values above it in the last.
+	static constexpr int StatHistogramSubBucketBits = 2;
+	static constexpr int StatHistogramMinExponent = -16;
+	static constexpr int StatHistogramBuckets = 48 << StatHistogramSubBucketBits;
+
+	inline int StatHistogramBucket(int64_t v)
+	{
+		if (v < (2 << StatHistogramSubBucketBits)) return (int)std::max(v, (int64_t)0);
+		// The octave, and then the bits below the leading one.
+		int shift = Log2Int((uint64_t)v) - StatHistogramSubBucketBits;
+		int bucket = ((shift + 1) << StatHistogramSubBucketBits) + int((v >> shift) & ((1 << StatHistogramSubBucketBits) - 1));
+		return std::min(bucket, StatHistogramBuckets - 1);
+	}
+
+	inline int StatHistogramBucket(double v)
+	{
+		// The exponent and the leading bits of the mantissa of a positive double increase with its value; the
+		// sign bit makes the shifted bits of a negative one negative, so that it ends up in the first bucket too.
+		int64_t bucket = (int64_t(FloatToBits(v)) >> (52 - StatHistogramSubBucketBits)) -
+			(int64_t(1023 + StatHistogramMinExponent) << StatHistogramSubBucketBits);
+		return (int)std::min(std::max(bucket, (int64_t)0), (int64_t)StatHistogramBuckets - 1);
+	}
+
+	// The largest int value that's counted in a bucket.
+	inline int64_t StatHistogramIntBucketMax(int bucket)
+	{
+		if (bucket < (2 << StatHistogramSubBucketBits)) return bucket;
+		int shift = (bucket >> StatHistogramSubBucketBits) - 1;
+		int64_t subBucket = (1 << StatHistogramSubBucketBits) + (bucket & ((1 << StatHistogramSubBucketBits) - 1));
+		return ((subBucket + 1) << shift) - 1;
+	}
+
+	// The float value that a bucket ends at; the next bucket starts with it.
+	inline double StatHistogramFloatBucketEnd(int bucket)
+	{
+		int subBuckets = 1 << StatHistogramSubBucketBits;
+		return std::ldexp(1. + double((bucket + 1) % subBuckets) / subBuckets,
+			(bucket + 1) / subBuckets + StatHistogramMinExponent);
+	}
+
 	class StatsAccumulator
 	{
 	public:
-		void ReportCounter(const std::string& name, int64_t val)
+		void ReportCounter(int id, int64_t val)
 		{
-			counters[name] += val;
+			entry(counters, id) += val;
 		}
-		void ReportMemoryCounter(const std::string& name, int64_t val)
+		void ReportMemoryCounter(int id, int64_t val)
 		{
-			memoryCounters[name] += val;
+			entry(memoryCounters, id) += val;
 		}
-		void ReportIntDistribution(const std::string& name, int64_t sum, int64_t count, int64_t min, int64_t max)
+		// histogram, if non-null, holds StatHistogramBuckets counts of the values.
+		void ReportIntDistribution(int id, int64_t sum, int64_t count, int64_t min, int64_t max,
+			const int64_t* histogram = nullptr)
 		{
-			intDistributionSums[name] += sum;
-			intDistributionCounts[name] += count;
-			if (intDistributionMins.find(name) == intDistributionMins.end())
-				intDistributionMins[name] = min;
-			else
-				intDistributionMins[name] = std::min(intDistributionMins[name], min);
-			if (intDistributionMaxs.find(name) == intDistributionMaxs.end())
-				intDistributionMaxs[name] = max;
-			else
-				intDistributionMaxs[name] = std::max(intDistributionMaxs[name], max);
+			entry(intDistributions, id).Add(sum, count, min, max, histogram);
 		}
-		void ReportFloatDistribution(const std::string& name, double sum, int64_t count, double min, double max)
+		void ReportFloatDistribution(int id, double sum, int64_t count, double min, double max,
+			const int64_t* histogram = nullptr)
 		{
-			floatDistributionSums[name] += sum;
-			floatDistributionCounts[name] += count;
-			if (floatDistributionMins.find(name) == floatDistributionMins.end())
-				floatDistributionMins[name] = min;
-			else
-				floatDistributionMins[name] = std::min(floatDistributionMins[name], min);
-			if (floatDistributionMaxs.find(name) == floatDistributionMaxs.end())
-				floatDistributionMaxs[name] = max;
-			else
-				floatDistributionMaxs[name] = std::max(floatDistributionMaxs[name], max);
+			entry(floatDistributions, id).Add(sum, count, min, max, histogram);
 		}
-		void ReportPercentage(const std::string& name, int64_t num, int64_t denom)
+		void ReportPercentage(int id, int64_t num, int64_t denom)
 		{
-			percentages[name].first += num;
-			percentages[name].second += denom;
+			std::pair<int64_t, int64_t>& p = entry(percentages, id);
+			p.first += num;
+			p.second += denom;
 		}
-		void ReportRatio(const std::string& name, int64_t num, int64_t denom)
+		void ReportRatio(int id, int64_t num, int64_t denom)
 		{
-			ratios[name].first += num;
-			ratios[name].second += denom;
+			std::pair<int64_t, int64_t>& r = entry(ratios, id);
+			r.first += num;
+			r.second += denom;
 		}
 
 		void Print(FILE* file);
 		void Clear();
 
 	private:
-		std::map<std::string, int64_t> counters;
-		std::map<std::string, int64_t> memoryCounters;
-		std::map<std::string, int64_t> intDistributionSums;
-		std::map<std::string, int64_t> intDistributionCounts;
-		std::map<std::string, int64_t> intDistributionMins;
-		std::map<std::string, int64_t> intDistributionMaxs;
-		std::map<std::string, double> floatDistributionSums;
-		std::map<std::string, int64_t> floatDistributionCounts;
-		std::map<std::string, double> floatDistributionMins;
-		std::map<std::string, double> floatDistributionMaxs;
-		std::map<std::string, std::pair<int64_t, int64_t>> percentages;
-		std::map<std::string, std::pair<int64_t, int64_t>> ratios;
+		template <typename T>
+		struct Distribution
+		{
+			void Add(T s, int64_t c, T mn, T mx, const int64_t* h)
+			{
+				sum += s;
+				count += c;
+				min = std::min(min, mn);
+				max = std::max(max, mx);
+				if (!h) return;
+				if (histogram.empty()) histogram.resize(StatHistogramBuckets);
+				for (int i = 0; i < StatHistogramBuckets; ++i) histogram[i] += h[i];
+			}
+			// Returns the value that the given fraction of the values are at or below, as far as the histogram
+			// tells: the end of the bucket the percentile falls in, kept within [min, max].
+			double Percentile(double fraction) const;
+
+			T sum = 0;
+			int64_t count = 0;
+			T min = std::numeric_limits<T>::max();
+			T max = std::numeric_limits<T>::lowest();
+			// Empty unless the values were reported with histograms.
+			std::vector<int64_t> histogram;
+		};
+
+		// The arrays only grow when a stat is first reported, so that all of them can be registered before
+		// the accumulator is created or not.
+		template <typename T>
+		static T& entry(std::vector<T>& values, int id)
+		{
+			if (id >= (int)values.size()) values.resize(id + 1);
+			return values[id];
+		}
+
+		// By ID.
+		std::vector<int64_t> counters;
+		std::vector<int64_t> memoryCounters;
+		std::vector<Distribution<int64_t>> intDistributions;
+		std::vector<Distribution<double>> floatDistributions;
+		std::vector<std::pair<int64_t, int64_t>> percentages;
+		std::vector<std::pair<int64_t, int64_t>> ratios;
 	};
 
 	// Statistics Macros
 #define STAT_COUNTER(title, var)											\
 	static GRAPHICS_THREAD_LOCAL int64_t var;								\
+	static const int STATS_ID##var =										\
+		StatRegisterer::RegisterStat(StatType::Counter, title);				\
 	static void STATS_FUNC##var(StatsAccumulator& accum)					\
 	{																		\
-		accum.ReportCounter(title, var);									\
+		accum.ReportCounter(STATS_ID##var, var);							\
 		var = 0;															\
 	}																		\
-	static StateRegisterer STATS_REG##var(STATS_FUNC##var)
+	static StatRegisterer STATS_REG##var(STATS_FUNC##var)
 #define STAT_MEMORY_COUNTER(title, var)										\
 	static GRAPHICS_THREAD_LOCAL int64_t var;								\
+	static const int STATS_ID##var =										\
+		StatRegisterer::RegisterStat(StatType::MemoryCounter, title);		\
 	static void STATS_FUNC##var(StatsAccumulator& accum)					\
 	{																		\
-		accum.ReportMemoryCounter(title, var);								\
+		accum.ReportMemoryCounter(STATS_ID##var, var);						\
 		var = 0;															\
 	}																		\
-	static StateRegisterer STATS_REG##var(STATS_FUNC##var)
+	static StatRegisterer STATS_REG##var(STATS_FUNC##var)
 
 #ifndef GRAPHICS_HAVE_CONSTEXPR
 #define STATS_INT64_T_MIN LLONG_MAX
-#define STATS_INT64_T_MAX _I64_MIN
+#define STATS_INT64_T_MAX LLONG_MIN
 #define STATS_DBL_T_MIN DBL_MAX
 #define STATS_DBL_T_MAX -DBL_MAX
 #else
-#define STATS_INT64_T_MIN std::numeric_limits<int64_t>::max();
-#define STATS_INT64_T_MAX std::numeric_limits<int64_t>::lowest();
-#define STATS_DBL_T_MIN std::numeric_limits<double>::max();
-#define STATS_DBL_T_MAX std::numeric_limits<double>::lowest();
+#define STATS_INT64_T_MIN std::numeric_limits<int64_t>::max()
+#define STATS_INT64_T_MAX std::numeric_limits<int64_t>::lowest()
+#define STATS_DBL_T_MIN std::numeric_limits<double>::max()
+#define STATS_DBL_T_MAX std::numeric_limits<double>::lowest()
 #endif
 
+// The number of values is only worked out from the histogram when the values are reported, which keeps
+// ReportValue() down to the same four updates as without the histogram.
 #define STAT_INT_DISTRIBUTION(title, var)									\
 	static GRAPHICS_THREAD_LOCAL int64_t var##sum;							\
-	static GRAPHICS_THREAD_LOCAL int64_t var##count;						\
 	static GRAPHICS_THREAD_LOCAL int64_t var##min = (STATS_INT64_T_MIN);	\
 	static GRAPHICS_THREAD_LOCAL int64_t var##max = (STATS_INT64_T_MAX);	\
+	static GRAPHICS_THREAD_LOCAL int64_t var##histogram[StatHistogramBuckets]; \
+	static const int STATS_ID##var =										\
+		StatRegisterer::RegisterStat(StatType::IntDistribution, title);		\
 	static void STATS_FUNC##var(StatsAccumulator& accum)					\
 	{																		\
-		accum.ReportIntDistribution(title, var##sum, var##count,			\
-									var##min,var##max);						\
+		int64_t count = 0;													\
+		for (int64_t c : var##histogram) count += c;						\
+		if (count == 0) return;												\
+		accum.ReportIntDistribution(STATS_ID##var, var##sum, count,			\
+									var##min, var##max, var##histogram);	\
 		var##sum = 0;														\
-		var##count = 0;														\
-		var##min = std::numeric_limits<int64_t>::max()						\
-		var##max = std::numeric_limits<int64_t>::lowest()					\
+		std::fill(var##histogram, var##histogram + StatHistogramBuckets, 0);\
+		var##min = std::numeric_limits<int64_t>::max();						\
+		var##max = std::numeric_limits<int64_t>::lowest();					\
 	}																		\
 	static StatRegisterer STATS_REG##var(STATS_FUNC##var)
 
 #define STAT_FLOAT_DISTRIBUTION(title, var)									\
 	static GRAPHICS_THREAD_LOCAL double var##sum;							\
-	static GRAPHICS_THREAD_LOCAL int64_t var##count;						\
-	static GRAPHICS_THREAD_LOCAL double var##min = (STATS_INT64_T_MIN);		\
-	static GRAPHICS_THREAD_LOCAL double var##max = (STATS_INT64_T_MAX);		\
+	static GRAPHICS_THREAD_LOCAL double var##min = (STATS_DBL_T_MIN);		\
+	static GRAPHICS_THREAD_LOCAL double var##max = (STATS_DBL_T_MAX);		\
+	static GRAPHICS_THREAD_LOCAL int64_t var##histogram[StatHistogramBuckets]; \
+	static const int STATS_ID##var =										\
+		StatRegisterer::RegisterStat(StatType::FloatDistribution, title);	\
 	static void STATS_FUNC##var(StatsAccumulator& accum)					\
 	{																		\
-		accum.ReportFloatDistribution(title, var##sum, var##count,			\
-									var##min,var##max);						\
+		int64_t count = 0;													\
+		for (int64_t c : var##histogram) count += c;						\
+		if (count == 0) return;												\
+		accum.ReportFloatDistribution(STATS_ID##var, var##sum, count,		\
+									var##min, var##max, var##histogram);	\
 		var##sum = 0;														\
-		var##count = 0;														\
-		var##min = std::numeric_limits<double>::max()						\
-		var##max = std::numeric_limits<double>::lowest()					\
+		std::fill(var##histogram, var##histogram + StatHistogramBuckets, 0);\
+		var##min = std::numeric_limits<double>::max();						\
+		var##max = std::numeric_limits<double>::lowest();					\
 	}																		\
 	static StatRegisterer STATS_REG##var(STATS_FUNC##var)
 
 #define ReportValue(var, value)												\
 	do {																	\
 		var##sum += value;													\
-		var##count += 1;													\
 		var##min = std::min(var##min, decltype(var##min)(value));			\
 		var##max = std::max(var##max, decltype(var##min)(value));			\
+		++var##histogram[StatHistogramBucket(decltype(var##min)(value))];	\
 	} while (0)																\
 
 #define STAT_PERCENT(title, numVar, denomVar)								\
 	static GRAPHICS_THREAD_LOCAL int64_t numVar, denomVar;					\
+	static const int STATS_ID##numVar =										\
+		StatRegisterer::RegisterStat(StatType::Percentage, title);			\
 	static void STATS_FUNC##numVar(StatsAccumulator& accum)					\
 	{																		\
-		accum.ReportPercentage(title, numVar, denomVar);					\
+		accum.ReportPercentage(STATS_ID##numVar, numVar, denomVar);			\
 		numVar = denomVar = 0;												\
 	}																		\
 	static StatRegisterer STATS_REG##numVar(STATS_FUNC##numVar)
 
 #define STAT_RATIO(title, numVar, denomVar)									\
 	static GRAPHICS_THREAD_LOCAL int64_t numVar, denomVar;					\
+	static const int STATS_ID##numVar =										\
+		StatRegisterer::RegisterStat(StatType::Ratio, title);				\
 	static void STATS_FUNC##numVar(StatsAccumulator& accum)					\
 	{																		\
-		accum.ReportRatio(title, numVar, denomVar);							\
+		accum.ReportRatio(STATS_ID##numVar, numVar, denomVar);				\
 		numVar = denomVar = 0;												\
 	}																		\
 	static StatRegisterer STATS_REG##numVar(STATS_FUNC##numVar)
@@ -291,9 +385,22 @@ namespace graphics
 	static_assert((int)Prof::NumProfCategories == sizeof(ProfNames) / sizeof(ProfNames[0]),
 		"ProfNames[] array and Prof enumerant have different numbers of entries!");
 
+	// The sampling profiler needs per-thread CPU-time timers, which are only used on Linux; elsewhere
+	// ProfilePhase still tracks the state, but no samples are taken.
+#if defined(__linux__) && !defined(GRAPHICS_HAVE_ITIMER)
+#define GRAPHICS_HAVE_ITIMER
+#endif
+
 	extern thread_local uint64_t ProfilerState;
 	inline uint64_t CurrentProfilerState() { return ProfilerState; }
 
+	// Set between InitProfiler() and CleanupProfiler() if Options::profileTraceFile is, in which case the
+	// categories that each thread turns on and off are recorded with timestamps, for a timeline. Otherwise
+	// ProfilePhase only pays for checking it.
+	extern std::atomic<bool> ProfileTracing;
+	// Records that the categories in 'bits' have started (or ended) in the calling thread.
+	void TraceProfilePhases(uint64_t bits, bool begin);
+
 	class ProfilePhase
 	{
 	public:
@@ -302,10 +409,13 @@ namespace graphics
 			categoryBit = ProfToBits(p);
 			reset = (ProfilerState & categoryBit) == 0;
 			ProfilerState |= categoryBit;
+			if (reset && ProfileTracing.load(std::memory_order_relaxed)) TraceProfilePhases(categoryBit, true);
 		}
 		~ProfilePhase()
 		{
-			if (reset) ProfilerState &= ~categoryBit;
+			if (!reset) return;
+			ProfilerState &= ~categoryBit;
+			if (ProfileTracing.load(std::memory_order_relaxed)) TraceProfilePhases(categoryBit, false);
 		}
 		ProfilePhase(const ProfilePhase&) = delete;
 		ProfilePhase& operator=(const ProfilePhase&) = delete;
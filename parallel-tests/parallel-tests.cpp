@@ -0,0 +1,1147 @@
+#include "parallel-tests.h"
+#include <fstream>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include <thread>
+
+namespace graphics
+{
+    // The tests are linked without an application to provide the global options.
+    Options RayTracerOptions;
+}
+
+// Keeps the calling thread busy, without sleeping, for the given time.
+static void busyFor(std::chrono::microseconds duration)
+{
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end) {}
+}
+
+// Work stealing tests
+
+TEST_F(ParallelTest, StealingSpreadsSkewedLoops)
+{
+    // All of the work is in the first 8 iterations, which the thread that starts the loop holds on to at
+    // first. They sleep rather than spin so that the threads can overlap however few processors there are.
+    std::vector<int> threadOfIteration(64, -1);
+    ParallelFor([&](int64_t i)
+        {
+            if (i < 8) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            threadOfIteration[i] = ThreadIndex;
+        }, 64);
+    std::set<int> threads(threadOfIteration.begin(), threadOfIteration.begin() + 8);
+    EXPECT_EQ(threads.count(-1), 0u);
+    EXPECT_GE(threads.size(), 2u);
+}
+
+// Chunk size tests
+
+TEST_F(ParallelTest, AutoChunkSizeGrowsChunksOfCheapIterations)
+{
+    // Iterations that take next to no time are handed out in chunks that are worth scheduling.
+    const int64_t n = 1000000;
+    std::mutex mutex;
+    std::vector<std::pair<int64_t, int64_t>> chunks;
+    std::vector<int64_t> values(n);
+    ParallelForChunks([&](int64_t begin, int64_t end)
+        {
+            for (int64_t i = begin; i < end; ++i) values[i] = i;
+            std::lock_guard<std::mutex> lock{ mutex };
+            chunks.push_back(std::make_pair(begin, end));
+        }, 0, n, AutoChunkSize);
+    EXPECT_LE(chunks.size(), 1000u);
+    std::sort(chunks.begin(), chunks.end());
+    int64_t next = 0;
+    for (const std::pair<int64_t, int64_t>& chunk : chunks)
+    {
+        ASSERT_EQ(chunk.first, next);
+        next = chunk.second;
+    }
+    EXPECT_EQ(next, n);
+
+    // Expensive ones end up in chunks of a few iterations as the loop runs out, so that it finishes evenly.
+    int64_t smallest = n;
+    ParallelForChunks([&](int64_t begin, int64_t end)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(end - begin));
+            std::lock_guard<std::mutex> lock{ mutex };
+            smallest = std::min(smallest, end - begin);
+        }, 0, 64, AutoChunkSize);
+    EXPECT_LE(smallest, 2);
+}
+
+// Nesting tests
+
+TEST_F(ParallelTest, NestedLoopsRunEveryIterationOnce)
+{
+    const int n = 16;
+    std::vector<std::atomic<int>> counts(n * n * n * n);
+    for (std::atomic<int>& count : counts) count = 0;
+    ParallelFor([&](int64_t a)
+        {
+            ParallelFor([&](int64_t b)
+                {
+                    ParallelFor([&](int64_t c)
+                        {
+                            ParallelFor([&](int64_t d) { ++counts[((a * n + b) * n + c) * n + d]; }, n);
+                        }, n);
+                }, n);
+        }, n);
+    for (const std::atomic<int>& count : counts) ASSERT_EQ(count, 1);
+}
+
+TEST_F(ParallelTest, NestedLoopsInsideTiles)
+{
+    // Like generating samples in parallel within each tile of an image.
+    Point2i nTiles(9, 7);
+    std::vector<int64_t> tileSums(nTiles.x * nTiles.y);
+    PrallelFor2D([&](Point2i tile)
+        {
+            tileSums[tile.y * nTiles.x + tile.x] = ParallelReduce(int64_t(5000), int64_t(0),
+                [&](int64_t i) { return i + tile.x + tile.y; }, std::plus<int64_t>());
+        }, nTiles);
+    for (int y = 0; y < nTiles.y; ++y)
+        for (int x = 0; x < nTiles.x; ++x)
+            EXPECT_EQ(tileSums[y * nTiles.x + x], 5000 * 4999 / 2 + 5000 * (x + y));
+}
+
+TEST_F(ParallelTest, NestedLoopsWaitingOnTasks)
+{
+    // The loop bodies wait on a task that was spawned outside of the loop, from deeper inside of it.
+    Future<int64_t> base = Spawn([]() { return int64_t(1000); });
+    std::atomic<int64_t> sum{ 0 };
+    ParallelFor([&](int64_t i)
+        {
+            ParallelFor([&](int64_t j) { sum += base.Get() + i + j; }, 50);
+        }, 50);
+    EXPECT_EQ(sum, 50 * 50 * 1000 + 2 * 50 * (50 * 49 / 2));
+}
+
+TEST_F(ParallelTest, NestedLoopWaitsDontStartOuterIterations)
+{
+    // A thread that waits for an inner loop to finish may help with it, but must not start another iteration
+    // of the outer loop on top of the one that's waiting.
+    static thread_local int outerIterationsOnStack = 0;
+    std::atomic<int> stacked{ 0 }, innerRun{ 0 };
+    ParallelFor([&](int64_t)
+        {
+            if (outerIterationsOnStack > 0) ++stacked;
+            ++outerIterationsOnStack;
+            ParallelFor([&](int64_t)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    ++innerRun;
+                }, 8);
+            --outerIterationsOnStack;
+        }, 32);
+    EXPECT_EQ(stacked, 0);
+    EXPECT_EQ(innerRun, 32 * 8);
+}
+
+// Cancellation tests
+
+TEST_F(ParallelTest, CancelStopsLoopEarly)
+{
+    CancellationToken cancel;
+    std::atomic<int64_t> nRun{ 0 };
+    int64_t reported = ParallelFor([&](int64_t)
+        {
+            if (++nRun == 1000) cancel.Cancel();
+        }, 10000000, cancel, 16);
+    EXPECT_EQ(reported, nRun);
+    EXPECT_GE(reported, 1000);
+    EXPECT_LT(reported, 10000000);
+}
+
+TEST_F(ParallelTest, PassedDeadlineRunsNothing)
+{
+    CancellationToken cancel(std::chrono::steady_clock::now() - std::chrono::seconds(1));
+    std::atomic<int64_t> nRun{ 0 };
+    EXPECT_EQ(ParallelFor([&](int64_t) { ++nRun; }, 100000, cancel), 0);
+    EXPECT_EQ(nRun, 0);
+}
+
+TEST_F(ParallelTest, UncancelledLoopRunsEverything)
+{
+    CancellationToken cancel(std::chrono::hours(1));
+    std::vector<int> counts(100000);
+    EXPECT_EQ(ParallelFor([&](int64_t i) { ++counts[i]; }, int64_t(counts.size()), cancel, AutoChunkSize),
+        int64_t(counts.size()));
+    for (int count : counts) ASSERT_EQ(count, 1);
+}
+
+// Barrier tests
+
+TEST(SpinBarrierTest, KeepsThreadsInStep)
+{
+    const int nThreads = 4, nPasses = 2000;
+    SpinBarrier barrier(nThreads);
+    std::vector<int> progress(nThreads);
+    std::atomic<int> nLast{ 0 }, nOutOfStep{ 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nThreads; ++t)
+        threads.push_back(std::thread([&, t]()
+            {
+                for (int pass = 0; pass < nPasses; ++pass)
+                {
+                    progress[t] = pass;
+                    if (barrier.Wait()) ++nLast;
+                    // Everybody has got as far as this pass, and nobody can get any further until all of the
+                    // threads have checked.
+                    for (int other = 0; other < nThreads; ++other)
+                        if (progress[other] != pass) ++nOutOfStep;
+                    barrier.Wait();
+                }
+            }));
+    for (std::thread& thread : threads) thread.join();
+    EXPECT_EQ(nLast, nPasses);
+    EXPECT_EQ(nOutOfStep, 0);
+}
+
+// Thread pool tests
+
+TEST_F(ParallelTest, PoolScopeRunsLoopsOnPool)
+{
+    std::shared_ptr<ThreadPool> background = MakeThreadPool(2, ThreadPriority::Background);
+    std::atomic<int64_t> sum{ 0 };
+    std::atomic<int> wrongPool{ 0 };
+    {
+        ThreadPoolScope scope(background.get());
+        ParallelFor([&](int64_t)
+            {
+                if (CurrentThreadPool() != background.get()) ++wrongPool;
+                // Nested loops stay on the pool of the loop they're started from.
+                ParallelFor([&](int64_t j) { sum += j; }, 100);
+            }, 1000);
+    }
+    EXPECT_EQ(sum, 1000 * (100 * 99 / 2));
+    EXPECT_EQ(wrongPool, 0);
+    EXPECT_NE(CurrentThreadPool(), background.get());
+}
+
+TEST_F(ParallelTest, ForegroundLoopsRunWhileBackgroundIsBusy)
+{
+    std::shared_ptr<ThreadPool> background = MakeThreadPool(2, ThreadPriority::Background);
+    std::atomic<bool> release{ false };
+    Future<int64_t> backgroundSum;
+    {
+        ThreadPoolScope scope(background.get());
+        // Keeps both of the background workers busy until the foreground work is done.
+        backgroundSum = Spawn([&]()
+            {
+                std::atomic<int64_t> sum{ 0 };
+                ParallelFor([&](int64_t i)
+                    {
+                        while (!release) std::this_thread::yield();
+                        sum += i;
+                    }, 2);
+                return sum.load();
+            });
+    }
+
+    for (int frame = 0; frame < 10; ++frame)
+    {
+        std::atomic<int64_t> sum{ 0 };
+        ParallelFor([&](int64_t i) { sum += i; }, 10000);
+        ASSERT_EQ(sum, 10000 * 9999 / 2);
+    }
+    EXPECT_FALSE(backgroundSum.IsReady());
+    release = true;
+    EXPECT_EQ(backgroundSum.Get(), 1);
+}
+
+TEST_F(ParallelTest, StatsMergeDoesntWaitForBusyPools)
+{
+    std::shared_ptr<ThreadPool> background = MakeThreadPool(2, ThreadPriority::Background);
+    std::atomic<bool> started{ false }, release{ false };
+    Future<void> busy;
+    {
+        ThreadPoolScope scope(background.get());
+        busy = Spawn([&]()
+            {
+                started = true;
+                while (!release) std::this_thread::yield();
+            });
+    }
+    while (!started) std::this_thread::yield();
+    // Lets the test finish, if slowly, should the merge wait for the task after all.
+    std::thread releaser([&]()
+        {
+            for (int i = 0; i < 500 && !release; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            release = true;
+        });
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    MergeWorkerThreadStats();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    EXPECT_FALSE(busy.IsReady());
+    release = true;
+    releaser.join();
+    busy.Wait();
+    ReportThreadStats();
+    ClearStats();
+}
+
+// NUMA tests
+
+TEST_F(NumaTest, LoopsForAnotherNodeWakeThatNodesWorkers)
+{
+    ASSERT_EQ(NumaNodeCount(), 2);
+    ASSERT_EQ(ThreadNumaNode(0), 0);
+    for (int round = 0; round < 20; ++round)
+    {
+        // Every other round gives the workers time to go to sleep first, so that one on node 1 has to be
+        // woken up; the others find them still spinning.
+        if (round % 2 == 0) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        std::atomic<int64_t> sum{ 0 };
+        std::atomic<int> wrongNode{ 0 };
+        ParallelFor([&](int64_t i)
+            {
+                if (ThreadNumaNode(ThreadIndex) != 1) ++wrongNode;
+                sum += i;
+            }, 1000, 1, 1);
+        ASSERT_EQ(sum, 1000 * 999 / 2);
+        ASSERT_EQ(wrongNode, 0);
+    }
+}
+
+TEST_F(NumaTest, LoopsRunOnlyOnTheirNode)
+{
+    for (int node = 0; node < 2; ++node)
+    {
+        std::vector<std::atomic<int>> iterationsByThread(MaxThreadIndex());
+        ParallelFor([&](int64_t)
+            {
+                busyFor(std::chrono::microseconds(1));
+                ++iterationsByThread[ThreadIndex];
+            }, 10000, 1, node);
+        int total = 0;
+        for (int t = 0; t < MaxThreadIndex(); ++t)
+        {
+            if (ThreadNumaNode(t) != node)
+            {
+                EXPECT_EQ(iterationsByThread[t], 0) << "thread " << t;
+            }
+            total += iterationsByThread[t];
+        }
+        EXPECT_EQ(total, 10000);
+    }
+
+    // A node that the pool doesn't have leaves the loop free to run anywhere.
+    std::atomic<int64_t> sum{ 0 };
+    ParallelFor([&](int64_t i) { sum += i; }, 10000, 1, 5);
+    EXPECT_EQ(sum, int64_t(10000) * 9999 / 2);
+}
+
+// Task tests
+
+TEST_F(ParallelTest, ThenRunsAfterWhatItContinues)
+{
+    std::mutex mutex;
+    std::vector<int> order;
+    auto record = [&](int step)
+    {
+        std::lock_guard<std::mutex> lock{ mutex };
+        order.push_back(step);
+    };
+    // The first step sleeps so that the continuations are all scheduled before it finishes.
+    Future<int> first = Spawn([&]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            record(1);
+            return 10;
+        });
+    Future<int> second = first.Then([&](int v)
+        {
+            record(2);
+            return v + 1;
+        });
+    Future<void> third = second.Then([&](int v) { record(v); });
+    Future<int> fourth = third.Then([&]()
+        {
+            record(4);
+            return 40;
+        });
+    EXPECT_EQ(fourth.Get(), 40);
+    EXPECT_EQ(second.Get(), 11);
+    EXPECT_EQ(order, std::vector<int>({ 1, 2, 11, 4 }));
+}
+
+TEST_F(ParallelTest, WhenAllWaitsForEveryFuture)
+{
+    std::atomic<int> finished{ 0 };
+    auto sleeper = [&](int ms)
+    {
+        return Spawn([&finished, ms]()
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+                ++finished;
+                return ms;
+            });
+    };
+    Future<int> a = sleeper(30), b = sleeper(1);
+    Future<void> c = Spawn([&]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(15));
+            ++finished;
+        });
+    WhenAll(a, b, c).Wait();
+    EXPECT_EQ(finished, 3);
+    EXPECT_TRUE(a.IsReady() && b.IsReady() && c.IsReady());
+
+    std::vector<Future<int>> futures;
+    for (int i = 0; i < 16; ++i) futures.push_back(sleeper(16 - i));
+    Future<int> total = WhenAll(futures).Then([&]()
+        {
+            int sum = 0;
+            for (const Future<int>& future : futures) sum += future.Get();
+            return sum;
+        });
+    EXPECT_EQ(total.Get(), 16 * 17 / 2);
+    EXPECT_EQ(finished, 3 + 16);
+}
+
+TEST_F(ParallelTest, SerialScopeTasksWaitForOtherPools)
+{
+    std::shared_ptr<ThreadPool> serial = MakeThreadPool(0);
+    Future<int> slow = Spawn([]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            return 20;
+        });
+    ThreadPoolScope scope(serial.get());
+    // Spawned on the serial pool, but left waiting for the default pool.
+    Future<int> next = slow.Then([](int v) { return v + 1; });
+    Future<int> last = next.Then([&](int v)
+        {
+            // Work it starts stays on the serial pool, whichever thread runs the task itself.
+            EXPECT_EQ(CurrentThreadPool(), serial.get());
+            int64_t sum = 0;
+            ParallelFor([&](int64_t i) { sum += i; }, 100);
+            return v + int(sum);
+        });
+    EXPECT_EQ(last.Get(), 21 + 100 * 99 / 2);
+    EXPECT_EQ(next.Get(), 21);
+}
+
+// Coroutine tests
+
+#ifdef GRAPHICS_HAVE_COROUTINES
+
+static async::Task<int> squareOnPool(int x)
+{
+    co_await async::Schedule();
+    co_return x * x;
+}
+
+static async::Task<int> loadAndDecode(int id)
+{
+    // A "read" that runs as a task, then a "decode" that's another coroutine.
+    int bytes = co_await Spawn([id]() { return id + 1; });
+    int decoded = co_await squareOnPool(bytes);
+    co_return decoded;
+}
+
+TEST_F(ParallelTest, CoroutineChainsRunOnPool)
+{
+    EXPECT_EQ(async::SyncWait(loadAndDecode(6)), 49);
+}
+
+TEST_F(ParallelTest, CoroutineWhenAllOverlapsManyTasks)
+{
+    std::vector<async::Task<int>> loads;
+    for (int i = 0; i < 2000; ++i) loads.push_back(loadAndDecode(i));
+    std::vector<int> results = async::SyncWait(async::WhenAll(std::move(loads)));
+    ASSERT_EQ(results.size(), 2000u);
+    for (int i = 0; i < 2000; ++i) ASSERT_EQ(results[i], (i + 1) * (i + 1));
+}
+
+TEST_F(ParallelTest, CoroutineVoidTasks)
+{
+    std::atomic<int> count{ 0 };
+    std::vector<async::Task<void>> tasks;
+    for (int i = 0; i < 100; ++i)
+        tasks.push_back([](std::atomic<int>* count) -> async::Task<void>
+            {
+                co_await async::Schedule();
+                ++*count;
+            }(&count));
+    async::SyncWait(async::WhenAll(std::move(tasks)));
+    EXPECT_EQ(count, 100);
+}
+
+#endif // GRAPHICS_HAVE_COROUTINES
+
+// Reduction and scan tests
+
+TEST_F(ParallelReduceTest, MatchesAccumulate)
+{
+    int64_t expected = std::accumulate(values.begin(), values.end(), int64_t(0));
+    int64_t sum = ParallelReduce(int64_t(values.size()), int64_t(0),
+        [&](int64_t i) { return values[i]; }, std::plus<int64_t>());
+    EXPECT_EQ(sum, expected);
+
+    EXPECT_EQ(ParallelReduce(int64_t(0), int64_t(7), [&](int64_t i) { return values[i]; }, std::plus<int64_t>()), 7);
+}
+
+TEST_F(ParallelReduceTest, Bounds)
+{
+    std::vector<Point2i> points(100000);
+    for (size_t i = 0; i < points.size(); ++i) points[i] = Point2i(int(i * 7919 % 1000) - 500, int(i % 313));
+    Bounds2i bounds = ParallelReduce(int64_t(points.size()), Bounds2i(),
+        [&](int64_t i) { return Bounds2i(points[i]); },
+        [](const Bounds2i& a, const Bounds2i& b)
+        {
+            Bounds2i u;
+            u.pMin = Min(a.pMin, b.pMin);
+            u.pMax = Max(a.pMax, b.pMax);
+            return u;
+        });
+    EXPECT_EQ(bounds.pMin.x, -500);
+    EXPECT_EQ(bounds.pMin.y, 0);
+    EXPECT_EQ(bounds.pMax.x, 499);
+    EXPECT_EQ(bounds.pMax.y, 312);
+}
+
+TEST_F(ParallelReduceTest, FloatSumIsReproducible)
+{
+    std::vector<float> f(values.begin(), values.end());
+    for (float& v : f) v *= 0.1f;
+    auto sum = [&]() { return ParallelReduce(int64_t(f.size()), 0.f, [&](int64_t i) { return f[i]; }, std::plus<float>()); };
+    float first = sum();
+    for (int i = 0; i < 10; ++i) EXPECT_EQ(sum(), first);
+}
+
+TEST_F(ParallelReduceTest, InclusiveScanMatchesPartialSum)
+{
+    std::vector<int64_t> expected(values.size()), scanned(values.size());
+    std::partial_sum(values.begin(), values.end(), expected.begin());
+    int64_t total = ParallelInclusiveScan(values.data(), scanned.data(), int64_t(values.size()));
+    EXPECT_EQ(scanned, expected);
+    EXPECT_EQ(total, expected.back());
+}
+
+TEST_F(ParallelReduceTest, ExclusiveScanInPlace)
+{
+    std::vector<int64_t> expected(values.size());
+    expected[0] = 0;
+    std::partial_sum(values.begin(), values.end() - 1, expected.begin() + 1);
+    int64_t total = ParallelExclusiveScan(values.data(), values.data(), int64_t(values.size()));
+    EXPECT_EQ(values, expected);
+    EXPECT_EQ(total, expected.back() + int64_t((values.size() - 1) % 97) - 40);
+}
+
+// Sorting tests
+
+TEST_F(RadixSortTest, Keys32)
+{
+    expectSortsLikeStableSort<uint32_t>(1000000, 32);
+    expectSortsLikeStableSort<uint32_t>(1000, 32);
+    expectSortsLikeStableSort<uint32_t>(1, 32);
+}
+
+TEST_F(RadixSortTest, Keys64)
+{
+    expectSortsLikeStableSort<uint64_t>(300000, 64);
+}
+
+TEST_F(RadixSortTest, FewDistinctKeysStayStable)
+{
+    expectSortsLikeStableSort<uint32_t>(500000, 3);
+    expectSortsLikeStableSort<uint64_t>(200000, 12);
+}
+
+TEST_F(RadixSortTest, KeysOnly)
+{
+    std::vector<uint32_t> keys = { 5, 3, 0xffffffffu, 0, 3, 17 };
+    RadixSort(&keys);
+    EXPECT_EQ(keys, std::vector<uint32_t>({ 0, 3, 3, 5, 17, 0xffffffffu }));
+}
+
+// Tile scheduling tests
+
+TEST_F(ParallelTest, PrallelFor2DVisitsEachPointOnceInEveryOrder)
+{
+    for (TileOrder order : { TileOrder::RowMajor, TileOrder::Morton, TileOrder::Hilbert })
+        for (Point2i count : { Point2i(1, 1), Point2i(37, 5), Point2i(6, 40), Point2i(64, 64) })
+        {
+            std::vector<std::atomic<int>> visits(count.x * count.y);
+            for (std::atomic<int>& v : visits) v = 0;
+            PrallelFor2D([&](Point2i p)
+                {
+                    ASSERT_TRUE(p.x >= 0 && p.x < count.x && p.y >= 0 && p.y < count.y);
+                    ++visits[p.y * count.x + p.x];
+                }, count, order);
+            for (const std::atomic<int>& v : visits) ASSERT_EQ(v, 1);
+        }
+}
+
+// Runs a pass over 8x8 tiles of 16x16 pixels, in which pixels of tile (5, 2) take 100 times as long as the
+// others. Returns the pieces in the order they were started, checking that they cover every pixel once.
+static std::vector<Bounds2i> runTilePass(TileCosts* costs)
+{
+    Bounds2i image;
+    image.pMin = Point2i(0, 0);
+    image.pMax = Point2i(128, 128);
+    std::mutex mutex;
+    std::vector<Bounds2i> pieces;
+    std::vector<int> covered(128 * 128);
+    ParallelForTiles([&](const Bounds2i& bounds)
+        {
+            {
+                std::lock_guard<std::mutex> lock{ mutex };
+                pieces.push_back(bounds);
+                for (int y = bounds.pMin.y; y < bounds.pMax.y; ++y)
+                    for (int x = bounds.pMin.x; x < bounds.pMax.x; ++x) ++covered[y * 128 + x];
+            }
+            bool expensive = bounds.pMin.x / 16 == 5 && bounds.pMin.y / 16 == 2;
+            std::this_thread::sleep_for(std::chrono::microseconds(bounds.Area() * (expensive ? 80 : 1)));
+        }, image, 16, costs);
+    for (int c : covered) EXPECT_EQ(c, 1);
+    return pieces;
+}
+
+// Sets up costs as measured by a pass in which tile (5, 2) took 100 ms and all of the others 1 ms.
+static void setTileCosts(TileCosts* costs)
+{
+    costs->Reset(Point2i(8, 8));
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 8; ++x) costs->Add(Point2i(x, y), (x == 5 && y == 2) ? 100000000 : 1000000);
+}
+
+TEST_F(ParallelTest, TileCostsStartExpensiveTilesFirst)
+{
+    ParallelCleanup();
+    RayTracerOptions.nThreads = 1;
+    ParallelInit();
+
+    // On its own, the thread has to do all of the work anyway; the expensive tile is only split in two since
+    // it's more than half of it. Both halves go first.
+    TileCosts costs;
+    setTileCosts(&costs);
+    std::vector<Bounds2i> pieces = runTilePass(&costs);
+    ASSERT_EQ(pieces.size(), 65);
+    for (int i = 0; i < 2; ++i)
+    {
+        EXPECT_EQ(pieces[i].pMin.x / 16, 5);
+        EXPECT_EQ(pieces[i].pMin.y / 16, 2);
+        EXPECT_EQ(pieces[i].Area(), 128);
+    }
+
+    // The pass measured the tiles anew.
+    EXPECT_EQ(costs.Count(), Point2i(8, 8));
+    EXPECT_GT(costs.Seconds(Point2i(5, 2)), 10 * costs.Seconds(Point2i(0, 0)));
+}
+
+TEST_F(ParallelTest, TileCostsSplitOutliers)
+{
+    // With four threads, each should do about 41 ms of the work, so the expensive tile is split into eighths.
+    TileCosts costs;
+    setTileCosts(&costs);
+    std::vector<Bounds2i> pieces = runTilePass(&costs);
+    EXPECT_EQ(pieces.size(), 71);
+    EXPECT_EQ(pieces[0].pMin.x / 16, 5);
+    EXPECT_EQ(pieces[0].pMin.y / 16, 2);
+
+    // Without costs for the same tiles, a pass measures them first.
+    costs.Reset(Point2i(4, 4));
+    EXPECT_EQ(runTilePass(&costs).size(), 64);
+    EXPECT_EQ(costs.Count(), Point2i(8, 8));
+    EXPECT_GT(costs.Seconds(Point2i(5, 2)), 10 * costs.Seconds(Point2i(0, 0)));
+
+    std::string filename = ::testing::TempDir() + "tilecosts.csv";
+    ASSERT_TRUE(costs.Write(filename));
+    std::ifstream in(filename);
+    std::string line;
+    int nLines = 0;
+    while (std::getline(in, line))
+    {
+        EXPECT_EQ(std::count(line.begin(), line.end(), ','), 7);
+        ++nLines;
+    }
+    EXPECT_EQ(nLines, 8);
+}
+
+// Deterministic mode tests
+
+TEST_F(DeterministicTest, ChunksDontDependOnThreadCount)
+{
+    std::vector<std::vector<std::pair<int64_t, int64_t>>> chunks;
+    for (int threads : { 1, 4, 7 })
+    {
+        restart(threads);
+        for (int chunkSize : { 7, AutoChunkSize })
+        {
+            std::mutex mutex;
+            std::vector<std::pair<int64_t, int64_t>> seen;
+            ParallelForChunks([&](int64_t begin, int64_t end)
+                {
+                    std::lock_guard<std::mutex> lock{ mutex };
+                    seen.push_back(std::make_pair(begin, end));
+                }, 3, 100003, chunkSize);
+            std::sort(seen.begin(), seen.end());
+            chunks.push_back(seen);
+        }
+    }
+    EXPECT_EQ(chunks[0].front(), std::make_pair(int64_t(3), int64_t(10)));
+    for (size_t i = 2; i < chunks.size(); ++i) EXPECT_EQ(chunks[i], chunks[i % 2]);
+}
+
+TEST_F(DeterministicTest, SplatBufferSumsDontDependOnThreads)
+{
+    // Values of very different magnitudes, so that the float sums depend on the order they're added in.
+    auto splatAll = [](SplatBuffer<float>* splats)
+    {
+        ParallelFor([&](int64_t i)
+            {
+                float value = (i % 3 == 0) ? 1e4f : 1.f / float(1 + i % 1000);
+                splats->Add(i % 5 == 0 ? 0 : i % splats->Size(), value);
+            }, 1 << 20, 64);
+        splats->Merge();
+    };
+
+    SplatBuffer<float> expected(1000);
+    splatAll(&expected);
+    for (int threads : { 4, 1, 7 })
+    {
+        restart(threads);
+        SplatBuffer<float> splats(1000);
+        splatAll(&splats);
+        for (int64_t i = 0; i < splats.Size(); ++i) ASSERT_EQ(splats[i], expected[i]);
+    }
+}
+
+// Accumulation tests
+
+TEST_F(ParallelTest, PerThreadCountsCombine)
+{
+    PerThread<int64_t> counts;
+    PerThread<std::vector<int>> seen(std::vector<int>(3, 1));
+    ParallelFor([&](int64_t i)
+        {
+            ++counts.Get();
+            ++seen.Get()[i % 3];
+        }, 100000, 64);
+    EXPECT_EQ(counts.Combine(int64_t(0), std::plus<int64_t>()), 100000);
+
+    int64_t seenTotal = 0;
+    seen.ForEach([&](const std::vector<int>& s) { for (int n : s) seenTotal += n; });
+    EXPECT_EQ(seenTotal, 100000 + 3 * seen.Size());
+}
+
+TEST_F(ParallelTest, SplatBufferSumsHotElements)
+{
+    // Most of the splats land on a handful of elements, the rest are spread over the whole buffer. The
+    // values are small integers, so the sums are exact whatever order they're added in.
+    SplatBuffer<float> splats(1 << 20);
+    const int64_t nSplats = 1 << 22;
+    ParallelFor([&](int64_t i)
+        {
+            int64_t index = (i % 4 != 0) ? (i % 7) : (i * 2654435761ll) % splats.Size();
+            splats.Add(index, 1.f);
+        }, nSplats, 1024);
+    splats.Merge();
+
+    std::vector<float> expected(splats.Size());
+    for (int64_t i = 0; i < nSplats; ++i) expected[(i % 4 != 0) ? (i % 7) : (i * 2654435761ll) % splats.Size()] += 1.f;
+    for (int64_t i = 0; i < splats.Size(); ++i) ASSERT_EQ(splats[i], expected[i]);
+}
+
+TEST_F(ParallelTest, SplatBufferMergesAcrossFrames)
+{
+    SplatBuffer<double> splats(1000);
+    for (int frame = 1; frame <= 3; ++frame)
+    {
+        ParallelFor([&](int64_t i) { splats.Add(i % splats.Size(), 0.5); }, 100000, 64);
+        splats.Merge();
+        for (int64_t i = 0; i < splats.Size(); ++i) ASSERT_EQ(splats[i], frame * 50.);
+    }
+    splats.Clear();
+    splats.Merge();
+    for (int64_t i = 0; i < splats.Size(); ++i) ASSERT_EQ(splats[i], 0.);
+}
+
+TEST_F(ParallelTest, SplatBufferTakesSplatsFromAnyThread)
+{
+    // The workers of two pools, and two threads that aren't workers of any, add to the same buffer at once.
+    // Their ThreadIndex values overlap, so each of them has to be kept apart some other way.
+    std::shared_ptr<ThreadPool> first = MakeThreadPool(2, ThreadPriority::Normal);
+    std::shared_ptr<ThreadPool> second = MakeThreadPool(3, ThreadPriority::Background);
+    SplatBuffer<double> splats(1000);
+    PerThread<int64_t> counts;
+    const int64_t n = 100000;
+    auto splat = [&](int64_t i)
+    {
+        splats.Add(i % splats.Size(), 1.);
+        ++counts.Get();
+    };
+    std::vector<std::thread> threads;
+    for (ThreadPool* pool : { first.get(), second.get() })
+        threads.push_back(std::thread([&, pool]()
+            {
+                ThreadPoolScope scope(pool);
+                ParallelFor(splat, n, 16);
+            }));
+    for (int t = 0; t < 2; ++t)
+        threads.push_back(std::thread([&]()
+            {
+                for (int64_t i = 0; i < n; ++i) splat(i);
+            }));
+    for (std::thread& thread : threads) thread.join();
+
+    splats.Merge();
+    for (int64_t i = 0; i < splats.Size(); ++i) ASSERT_EQ(splats[i], 4. * n / splats.Size());
+    EXPECT_EQ(counts.Combine(int64_t(0), std::plus<int64_t>()), 4 * n);
+}
+
+// Hash map tests
+
+TEST_F(ParallelTest, HashMapCreatesEachValueOnce)
+{
+    // Many threads ask for the same few thousand keys at once; each value must be created exactly once.
+    ConcurrentHashMap<int64_t> map(5000);
+    std::atomic<int> nCreated{ 0 };
+    ParallelFor([&](int64_t i)
+        {
+            uint64_t key = uint64_t(i % 5000) << 32;
+            const int64_t* value = map.FindOrInsert(key, [&]()
+                {
+                    ++nCreated;
+                    return 3 * (i % 5000);
+                });
+            ASSERT_EQ(*value, 3 * (i % 5000));
+        }, 200000, 16);
+    EXPECT_EQ(nCreated, 5000);
+    EXPECT_EQ(map.Size(), 5000);
+    EXPECT_FALSE(map.Insert(0, 7));
+    EXPECT_EQ(*map.Find(0), 0);
+    EXPECT_EQ(map.Find(uint64_t(5000) << 32), nullptr);
+
+    int64_t sum = 0;
+    map.ForEach([&](uint64_t, int64_t value) { sum += value; });
+    EXPECT_EQ(sum, 3 * int64_t(4999) * 5000 / 2);
+}
+
+TEST_F(ParallelTest, GrowableHashMapGrowsWhileInUse)
+{
+    // Starting tiny, the map has to grow many times while other threads insert and look up entries.
+    GrowableConcurrentHashMap<uint64_t> map(4);
+    const int64_t n = 100000;
+    ParallelFor([&](int64_t i)
+        {
+            EXPECT_TRUE(map.Insert(i * 7919, i));
+            const uint64_t* value = map.Find(i * 7919);
+            ASSERT_TRUE(value);
+            ASSERT_EQ(*value, uint64_t(i));
+            // Inserted by another thread or not yet, but not with any other value.
+            value = map.Find((n - 1 - i) * 7919);
+            if (value)
+            {
+                ASSERT_EQ(*value, uint64_t(n - 1 - i));
+            }
+        }, n, 64);
+    EXPECT_EQ(map.Size(), n);
+    EXPECT_GE(map.Capacity(), 2 * n);
+    for (int64_t i = 0; i < n; ++i) ASSERT_EQ(*map.Find(i * 7919), uint64_t(i));
+    EXPECT_EQ(map.Find(n * 7919), nullptr);
+}
+
+// Stats tests
+
+TEST(StatsTest, TitlesShareIdsAndPrintInOrder)
+{
+    int a = StatRegisterer::RegisterStat(StatType::Counter, "Tests/Counted b");
+    int b = StatRegisterer::RegisterStat(StatType::Counter, "Tests/Counted a");
+    EXPECT_NE(a, b);
+    EXPECT_EQ(StatRegisterer::RegisterStat(StatType::Counter, "Tests/Counted b"), a);
+    int d = StatRegisterer::RegisterStat(StatType::IntDistribution, "Tests/Counted b");
+    EXPECT_EQ(StatRegisterer::StatTitle(StatType::IntDistribution, d), "Tests/Counted b");
+
+    StatsAccumulator accum;
+    accum.ReportCounter(a, 5);
+    accum.ReportCounter(a, 7);
+    accum.ReportCounter(b, 1);
+    accum.ReportIntDistribution(d, 10, 2, 3, 7);
+    accum.ReportIntDistribution(d, 0, 0, std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::lowest());
+
+    FILE* f = tmpfile();
+    accum.Print(f);
+    rewind(f);
+    std::string printed;
+    for (int c; (c = fgetc(f)) != EOF;) printed += char(c);
+    fclose(f);
+    size_t counterA = printed.find("Counted a"), counterB = printed.find("Counted b");
+    ASSERT_NE(counterA, std::string::npos);
+    ASSERT_NE(counterB, std::string::npos);
+    EXPECT_LT(counterA, counterB);
+    EXPECT_NE(printed.find("12", counterB), std::string::npos);
+    EXPECT_NE(printed.find("5.000 avg [range 3 - 7]"), std::string::npos);
+}
+
+STAT_INT_DISTRIBUTION("Tests/Values reported", testValues);
+
+TEST(StatsTest, DistributionsPrintPercentiles)
+{
+    // The smallest int values have buckets of their own; past them, every value is within its bucket.
+    for (int64_t i = 1; i <= 7; ++i)
+    {
+        EXPECT_EQ(StatHistogramIntBucketMax(StatHistogramBucket(i)), i);
+        EXPECT_LT(StatHistogramBucket(i - 1), StatHistogramBucket(i));
+    }
+    for (int64_t i = 8; i < 100000; ++i)
+    {
+        int bucket = StatHistogramBucket(i);
+        ASSERT_GE(StatHistogramIntBucketMax(bucket), i);
+        ASSERT_LT(StatHistogramIntBucketMax(bucket - 1), i);
+    }
+    EXPECT_EQ(StatHistogramBucket(int64_t(-5)), 0);
+    EXPECT_EQ(StatHistogramBucket(std::numeric_limits<int64_t>::max()), StatHistogramBuckets - 1);
+    EXPECT_EQ(StatHistogramFloatBucketEnd(StatHistogramBucket(1.)), 1.25);
+    EXPECT_EQ(StatHistogramBucket(-5.), 0);
+    EXPECT_EQ(StatHistogramBucket(1e300), StatHistogramBuckets - 1);
+
+    // Percentiles are given as the end of the bucket they fall in, up to the largest value: 500 is in
+    // [448, 511], and 900 and 990 are both in [896, 1023].
+    for (int i = 1; i <= 1000; ++i) ReportValue(testValues, i);
+    StatsAccumulator accum;
+    StatRegisterer::CallCallbacks(accum);
+    FILE* f = tmpfile();
+    accum.Print(f);
+    rewind(f);
+    std::string printed;
+    for (int c; (c = fgetc(f)) != EOF;) printed += char(c);
+    fclose(f);
+    EXPECT_NE(printed.find("500.500 avg [range 1 - 1000] p50 511 p90 1000 p99 1000"), std::string::npos) << printed;
+}
+
+TEST_F(ParallelTest, LoopTraceAndCountersCoverEveryChunk)
+{
+    std::string filename = ::testing::TempDir() + "looptrace.csv";
+    RayTracerOptions.loopTraceFile = filename;
+    // Starts the counters from zero, with workers that haven't counted anything yet.
+    ParallelCleanup();
+    ParallelInit();
+    ReportThreadStats();
+    ClearStats();
+
+    ParallelFor([](int64_t) { busyFor(std::chrono::microseconds(1)); }, 10000, 100);
+
+    // Closes the trace. The workers report their stats as they exit, so none of them can still be busy
+    // finishing up its last chunk when the stats are printed.
+    RayTracerOptions.loopTraceFile.clear();
+    ParallelCleanup();
+    ReportThreadStats();
+    FILE* f = tmpfile();
+    PrintStats(f);
+    rewind(f);
+    std::string printed;
+    for (int c; (c = fgetc(f)) != EOF;) printed += char(c);
+    fclose(f);
+    ClearStats();
+    ParallelInit();
+
+    // The counter's value ends its line.
+    auto counter = [&](const std::string& title) -> int64_t
+    {
+        size_t pos = printed.find(title + " ");
+        if (pos == std::string::npos) return 0;
+        size_t eol = printed.find('\n', pos);
+        return atoll(printed.c_str() + printed.find_last_of(' ', eol) + 1);
+    };
+    // Threads run more than one chunk at a time while nobody else is short of work, so the loop is run in
+    // at most 100 calls, each of which the counters and the trace see.
+    int64_t calls = counter("Chunks run");
+    EXPECT_GE(calls, 1);
+    EXPECT_LE(calls, 100);
+    EXPECT_EQ(counter("Iterations run"), 10000) << printed;
+
+    std::ifstream in(filename);
+    std::string line;
+    ASSERT_TRUE(std::getline(in, line));
+    EXPECT_EQ(line, "loop,thread,begin,end,start_us,end_us");
+    std::vector<int> covered(10000);
+    int rows = 0;
+    while (std::getline(in, line))
+    {
+        long long loop, begin, end;
+        int thread;
+        double start, finish;
+        ASSERT_EQ(sscanf(line.c_str(), "%lld,%d,%lld,%lld,%lf,%lf", &loop, &thread, &begin, &end, &start, &finish), 6)
+            << line;
+        EXPECT_EQ(loop, 0);
+        EXPECT_GE(thread, 0);
+        EXPECT_LT(thread, nThreads);
+        ASSERT_GE(begin, 0);
+        ASSERT_LE(end, 10000);
+        EXPECT_LE(start, finish);
+        for (long long i = begin; i < end; ++i) ++covered[i];
+        ++rows;
+    }
+    EXPECT_EQ(rows, calls);
+    for (int i = 0; i < 10000; ++i) ASSERT_EQ(covered[i], 1) << "iteration " << i;
+}
+
+// Profiler tests
+
+TEST_F(ParallelTest, ProfileTraceNestsPhasesPerThread)
+{
+    std::string filename = ::testing::TempDir() + "profiletrace.json";
+    RayTracerOptions.profileTraceFile = filename;
+    InitProfiler();
+    {
+        ProfilePhase render(Prof::IntegratorRender);
+        ParallelFor([](int64_t)
+            {
+                ProfilePhase p(Prof::TriIntersect);
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }, 4 * nThreads, 1);
+    }
+    CleanupProfiler();
+    RayTracerOptions.profileTraceFile.clear();
+    ClearProfiler();
+
+    std::ifstream in(filename);
+    std::string trace((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(trace.compare(0, 15, "{\"traceEvents\":"), 0) << trace;
+
+    // Every begin has its end, on the same thread, and every iteration shows up.
+    std::map<int, int> depth;
+    int intersections = 0;
+    std::istringstream lines(trace);
+    for (std::string line; std::getline(lines, line);)
+    {
+        size_t tid = line.find("\"tid\":");
+        if (line.find("\"ph\":\"M\"") != std::string::npos || tid == std::string::npos) continue;
+        int t = atoi(line.c_str() + tid + 6);
+        if (line.find("\"ph\":\"B\"") != std::string::npos)
+        {
+            ++depth[t];
+            if (line.find("Triangle::Intersect()") != std::string::npos) ++intersections;
+        }
+        else
+            EXPECT_GT(depth[t]--, 0) << line;
+    }
+    for (const std::pair<const int, int>& d : depth) EXPECT_EQ(d.second, 0) << "thread " << d.first;
+    EXPECT_EQ(intersections, 4 * nThreads);
+    EXPECT_GE(depth.size(), 2u);
+}
+
+TEST_F(ParallelTest, ProfileTraceKeepsThreadsThatExited)
+{
+    std::string filename = ::testing::TempDir() + "profiletrace.json";
+    RayTracerOptions.profileTraceFile = filename;
+    // The second trace starts out without the buffers the first one freed.
+    for (int trace = 0; trace < 2; ++trace)
+    {
+        InitProfiler();
+        std::thread([]() { ProfilePhase p(Prof::TriIntersect); }).join();
+        CleanupProfiler();
+        ClearProfiler();
+
+        std::ifstream in(filename);
+        std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        EXPECT_NE(written.find("Triangle::Intersect()"), std::string::npos) << written;
+    }
+    RayTracerOptions.profileTraceFile.clear();
+}
+
+#ifdef GRAPHICS_HAVE_ITIMER
+
+// Keeps the calling thread busy until it has used the given amount of CPU time.
+static void spinFor(double seconds)
+{
+    auto cpuTime = []()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    };
+    double end = cpuTime() + seconds;
+    volatile uint64_t x = 0;
+    while (cpuTime() < end) x = x + 1;
+}
+
+static std::string profilerResults()
+{
+    FILE* f = tmpfile();
+    ReportProfilerResults(f);
+    rewind(f);
+    std::string printed;
+    for (int c; (c = fgetc(f)) != EOF;) printed += char(c);
+    fclose(f);
+    return printed;
+}
+
+TEST_F(ParallelTest, ProfilerSamplesEveryThread)
+{
+    RayTracerOptions.profileSampleRate = 1000;
+    InitProfiler();
+    {
+        ProfilePhase render(Prof::IntegratorRender);
+        spinFor(0.05);
+        // The workers each take their own samples, in the state the loop was started in.
+        ParallelFor([](int64_t)
+            {
+                ProfilePhase p(Prof::TriIntersect);
+                spinFor(0.1);
+            }, nThreads, 1);
+    }
+    CleanupProfiler();
+    RayTracerOptions.profileSampleRate = 100;
+
+    std::string printed = profilerResults();
+    EXPECT_NE(printed.find("Integrator::Render()"), std::string::npos) << printed;
+    size_t tri = printed.find("Triangle::Intersect()");
+    ASSERT_NE(tri, std::string::npos) << printed;
+    // All four of the loop's 0.1s should be accounted for, whichever threads ran the iterations.
+    const char* time = printed.c_str() + printed.find("% (", tri) + 3;
+    int h, m, sec, cs;
+    ASSERT_EQ(sscanf(time, "%d:%d:%d.%d", &h, &m, &sec, &cs), 4) << printed;
+    EXPECT_NEAR(sec + cs / 100., 0.1 * nThreads, 0.06) << printed;
+    EXPECT_EQ(printed.find("dropped"), std::string::npos) << printed;
+    ClearProfiler();
+}
+
+TEST_F(ParallelTest, ProfilerChargesCountersToCategories)
+{
+    RayTracerOptions.profileSampleRate = 1000;
+    RayTracerOptions.profileCounters = true;
+    InitProfiler();
+    {
+        ProfilePhase p(Prof::AccelIntersect);
+        ParallelFor([](int64_t) { spinFor(0.05); }, nThreads, 1);
+    }
+    CleanupProfiler();
+    RayTracerOptions.profileSampleRate = 100;
+    RayTracerOptions.profileCounters = false;
+
+    std::string printed = profilerResults();
+    ClearProfiler();
+    if (printed.find("Hardware counters could not be opened") != std::string::npos)
+        GTEST_SKIP() << "No hardware counters here";
+    size_t accel = printed.find("Accelerator::Intersect()");
+    ASSERT_NE(accel, std::string::npos) << printed;
+    double ipc = 0;
+    ASSERT_EQ(sscanf(printed.c_str() + printed.find(" IPC", accel), " IPC %lf", &ipc), 1) << printed;
+    EXPECT_GT(ipc, 0) << printed;
+}
+
+TEST_F(ParallelTest, ProfilerSamplesPoolsMadeWhileRunning)
+{
+    RayTracerOptions.profileSampleRate = 1000;
+    InitProfiler();
+    {
+        std::shared_ptr<ThreadPool> pool = MakeThreadPool(2, ThreadPriority::Background);
+        ThreadPoolScope scope(pool.get());
+        ProfilePhase p(Prof::TriIntersect);
+        ParallelFor([](int64_t) { spinFor(0.05); }, 4, 1);
+    }
+    CleanupProfiler();
+    RayTracerOptions.profileSampleRate = 100;
+
+    std::string printed = profilerResults();
+    ClearProfiler();
+    EXPECT_NE(printed.find("Triangle::Intersect()"), std::string::npos) << printed;
+}
+
+#endif // GRAPHICS_HAVE_ITIMER
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "graphics.h"
+#include "geometry.h"
+#include "parallel.h"
+#include "stats.h"
+#include "async.h"
+#include "hashmap.h"
+#include "gtest/gtest.h"
+
+using namespace graphics;
+
+class ParallelTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        RayTracerOptions.nThreads = nThreads;
+        ParallelInit();
+    }
+    void TearDown() override { ParallelCleanup(); }
+
+    int nThreads = 4;
+};
+
+// Deterministic mode tests
+
+class DeterministicTest : public ParallelTest
+{
+protected:
+    void SetUp() override
+    {
+        RayTracerOptions.deterministic = true;
+        ParallelTest::SetUp();
+    }
+    void TearDown() override
+    {
+        ParallelTest::TearDown();
+        RayTracerOptions.deterministic = false;
+    }
+
+    // Starts the default pool over with a different number of threads.
+    void restart(int threads)
+    {
+        ParallelCleanup();
+        RayTracerOptions.nThreads = threads;
+        ParallelInit();
+    }
+};
+
+// NUMA tests
+
+// Runs the default pool as if the machine had two NUMA nodes, with the main thread and worker 1 on node 0 and
+// workers 2 and 3 on node 1. The nodes are made up of processors that don't exist, so pinning fails and leaves
+// the threads free to run anywhere, but the pool still keeps loops tied to a node to that node's threads.
+class NumaTest : public ParallelTest
+{
+protected:
+    void SetUp() override
+    {
+        RayTracerOptions.numaNodes = { { 1000 }, { 1001 } };
+        RayTracerOptions.threadAffinity = ThreadAffinity::List;
+        RayTracerOptions.threadProcessors = { 1000, 1000, 1001, 1001 };
+        ParallelTest::SetUp();
+    }
+    void TearDown() override
+    {
+        ParallelTest::TearDown();
+        RayTracerOptions.numaNodes.clear();
+        RayTracerOptions.threadAffinity = ThreadAffinity::None;
+        RayTracerOptions.threadProcessors.clear();
+    }
+};
+
+// Reduction and scan tests
+
+class ParallelReduceTest : public ParallelTest
+{
+protected:
+    void SetUp() override
+    {
+        ParallelTest::SetUp();
+        for (size_t i = 0; i < values.size(); ++i) values[i] = int64_t(i % 97) - 40;
+    }
+
+    std::vector<int64_t> values = std::vector<int64_t>(1000003);
+};
+
+// Sorting tests
+
+class RadixSortTest : public ParallelTest
+{
+protected:
+    // Fills keys with pseudo-random values of which only the low 'bits' bits can be non-zero, and values with
+    // the original index of each key.
+    template <typename Key>
+    void generate(std::vector<Key>* keys, std::vector<int>* values, int n, int bits)
+    {
+        keys->resize(n);
+        values->resize(n);
+        uint64_t state = 0x853c49e6748fea9bull;
+        for (int i = 0; i < n; ++i)
+        {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            uint64_t r = state ^ (state >> 29);
+            (*keys)[i] = Key(bits >= 64 ? r : r & ((1ull << bits) - 1));
+            (*values)[i] = i;
+        }
+    }
+
+    // Sorts with RadixSort() and std::stable_sort() and checks that both agree, payload included.
+    template <typename Key>
+    void expectSortsLikeStableSort(int n, int bits)
+    {
+        std::vector<Key> keys;
+        std::vector<int> values;
+        generate(&keys, &values, n, bits);
+
+        std::vector<std::pair<Key, int>> expected(n);
+        for (int i = 0; i < n; ++i) expected[i] = std::make_pair(keys[i], values[i]);
+        std::stable_sort(expected.begin(), expected.end(),
+            [](const std::pair<Key, int>& a, const std::pair<Key, int>& b) { return a.first < b.first; });
+
+        RadixSort(&keys, &values);
+        for (int i = 0; i < n; ++i)
+        {
+            ASSERT_EQ(keys[i], expected[i].first);
+            ASSERT_EQ(values[i], expected[i].second);
+        }
+    }
+};